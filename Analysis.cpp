@@ -0,0 +1,160 @@
+#include "Analysis.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+
+
+// Deposits the particles [first, last) of this process, and sums the products of all the processes on the main one.
+// The map covers the given bounds of the tree's root: xMin, xMax, yMin, yMax, zMin, zMax.
+void Analysis::compute(Particle* particles, long first, long last, const float* bounds, MPI_Comm communicator)
+{
+    const int gridSize = ANALYSIS_GRID_SIZE;
+    const int shellCount = ANALYSIS_RADIAL_BINS;
+
+    // Center of mass of all the particles.
+    double mass = 0, x = 0, y = 0, z = 0;
+
+    #pragma omp parallel for reduction(+:mass, x, y, z)
+    for(long i=first; i<last; i++)
+    {
+        mass += particles[i].mass;
+        x += (double)particles[i].mass * particles[i].x;
+        y += (double)particles[i].mass * particles[i].y;
+        z += (double)particles[i].mass * particles[i].z;
+    }
+
+    double moments[4] = {mass, x, y, z};
+    MPI_Allreduce(MPI_IN_PLACE, moments, 4, MPI_DOUBLE, MPI_SUM, communicator);
+
+    this->totalMass = moments[0];
+    for(int axis=0; axis<3; axis++)
+    {
+        this->center[axis] = moments[0] > 0 ? moments[axis + 1] / moments[0] : 0;
+    }
+
+    // The shells reach the farthest particle, so that the profile holds all the mass.
+    double radius = 0;
+
+    #pragma omp parallel for reduction(max:radius)
+    for(long i=first; i<last; i++)
+    {
+        double dx = particles[i].x - this->center[0], dy = particles[i].y - this->center[1], dz = particles[i].z - this->center[2];
+        radius = std::max(radius, std::sqrt(dx*dx + dy*dy + dz*dz));
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &radius, 1, MPI_DOUBLE, MPI_MAX, communicator);
+
+    std::copy(bounds, bounds + 4, this->mapBounds);
+    this->densityMap.assign(gridSize * gridSize, 0);
+    this->radialMass.assign(shellCount, 0);
+    this->outsideMass = 0;
+
+    double cellWidth = (this->mapBounds[1] - this->mapBounds[0]) / gridSize;
+    double cellHeight = (this->mapBounds[3] - this->mapBounds[2]) / gridSize;
+    this->shellWidth = radius > 0 ? radius / shellCount : 1;
+    double outsideMass = 0;
+
+    // Every thread deposits into its own copy, added to the process' one at the end.
+    #pragma omp parallel reduction(+:outsideMass)
+    {
+        std::vector<double> map(gridSize * gridSize, 0), profile(shellCount, 0);
+
+        #pragma omp for
+        for(long i=first; i<last; i++)
+        {
+            Particle* particle = &particles[i];
+
+            // Cloud in cell: the mass is split between the 4 cells nearest to the particle.
+            double u = (particle->x - this->mapBounds[0]) / cellWidth - 0.5;
+            double v = (particle->y - this->mapBounds[2]) / cellHeight - 0.5;
+
+            // The weights falling past the edges of the map go to the edge cells.
+            if(-0.5 <= u && u <= gridSize - 0.5 && -0.5 <= v && v <= gridSize - 0.5)
+            {
+                int column = (int)std::floor(u), row = (int)std::floor(v);
+                double du = u - column, dv = v - row;
+                double weights[4] = {(1 - du) * (1 - dv), du * (1 - dv), (1 - du) * dv, du * dv};
+
+                for(int j=0; j<4; j++)
+                {
+                    int c = std::min(std::max(column + (j & 1), 0), gridSize - 1);
+                    int r = std::min(std::max(row + (j >> 1), 0), gridSize - 1);
+                    map[r * gridSize + c] += weights[j] * particle->mass;
+                }
+            }
+            else
+            {
+                outsideMass += particle->mass;
+            }
+
+            double dx = particle->x - this->center[0], dy = particle->y - this->center[1], dz = particle->z - this->center[2];
+            int shell = std::min((int)(std::sqrt(dx*dx + dy*dy + dz*dz) / this->shellWidth), shellCount - 1);
+            profile[shell] += particle->mass;
+        }
+
+        #pragma omp critical
+        {
+            for(int j=0; j<gridSize * gridSize; j++)
+            {
+                this->densityMap[j] += map[j];
+            }
+            for(int j=0; j<shellCount; j++)
+            {
+                this->radialMass[j] += profile[j];
+            }
+        }
+    }
+
+    int rank;
+    MPI_Comm_rank(communicator, &rank);
+
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : this->densityMap.data(), this->densityMap.data(), gridSize * gridSize, MPI_DOUBLE, MPI_SUM, 0, communicator);
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : this->radialMass.data(), this->radialMass.data(), shellCount, MPI_DOUBLE, MPI_SUM, 0, communicator);
+    MPI_Reduce(&outsideMass, &this->outsideMass, 1, MPI_DOUBLE, MPI_SUM, 0, communicator);
+}
+
+
+// Writes the surface density map to path_density.txt, one row of the grid per line,
+// and the radial profile to path_profile.csv. Warns when some mass fell outside the map.
+void Analysis::write(const std::string& path)
+{
+    const int gridSize = ANALYSIS_GRID_SIZE;
+    const int shellCount = ANALYSIS_RADIAL_BINS;
+
+    std::ofstream map(path + "_density.txt");
+    std::ofstream profile(path + "_profile.csv");
+
+    if(!map || !profile)
+    {
+        fprintf(stderr, "Failed to write the analysis %s\n", path.c_str());
+        return;
+    }
+
+    if(this->outsideMass > 0)
+    {
+        fprintf(stderr, "%g of the mass is outside the density map of %s\n", this->outsideMass / this->totalMass, path.c_str());
+    }
+
+    double cellArea = (this->mapBounds[1] - this->mapBounds[0]) / gridSize * (this->mapBounds[3] - this->mapBounds[2]) / gridSize;
+    for(int r=0; r<gridSize; r++)
+    {
+        for(int c=0; c<gridSize; c++)
+        {
+            map<<(c > 0 ? " " : "")<<this->densityMap[r * gridSize + c] / cellArea;
+        }
+        map<<"\n";
+    }
+
+    double shellWidth = this->shellWidth;
+    double enclosedMass = 0;
+
+    profile<<"inner radius,outer radius,mass,enclosed mass,density\n";
+    for(int j=0; j<shellCount; j++)
+    {
+        double inner = j * shellWidth, outer = (j + 1) * shellWidth;
+        enclosedMass += this->radialMass[j];
+
+        profile<<inner<<","<<outer<<","<<this->radialMass[j]<<","<<enclosedMass;
+        profile<<","<<this->radialMass[j] / (4.0 / 3.0 * PI * (outer*outer*outer - inner*inner*inner))<<"\n";
+    }
+}
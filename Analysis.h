@@ -0,0 +1,37 @@
+#ifndef NBODY_ANALYSIS_H
+#define NBODY_ANALYSIS_H
+
+#include "common.h"
+#include "Particle.h"
+#include <mpi.h>
+#include <string>
+#include <vector>
+
+class Particle;
+
+
+// Reduced products of the particles of all the processes, computed in place of writing the particles out.
+//
+// The density map is the mass projected along z onto an ANALYSIS_GRID_SIZE square grid over the x and y bounds of the
+// tree's root, deposited with cloud-in-cell weights, and the mass outside them is reported. The radial profile is the
+// mass in ANALYSIS_RADIAL_BINS shells of equal width around the center of mass, out to the farthest particle. Every
+// process deposits its own particles with all its threads, and the results are summed on the main process.
+class Analysis {
+public:
+    // Mass per cell of the map, row by row along y, and per shell of the profile. Only complete on the main process.
+    std::vector<double> densityMap;
+    std::vector<double> radialMass;
+    double center[3];
+    // Bounds of the map: xMin, xMax, yMin, yMax, and width of the shells.
+    double mapBounds[4];
+    double shellWidth;
+    // Mass of all the particles, and the part of it deposited outside the map.
+    double totalMass;
+    double outsideMass;
+
+    void compute(Particle*, long, long, const float*, MPI_Comm);
+    void write(const std::string&);
+};
+
+
+#endif
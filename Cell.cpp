@@ -3,18 +3,21 @@
 #include <cmath>
 
 
-Cell::Cell() {};
+Cell::Cell()
+{
+    this->trackMemory();
+};
 
 
 Cell::Cell(float xMin, float xMax, float yMin, float yMax, float zMin, float zMax) :
         xMin(xMin), xMax(xMax), yMin(yMin), yMax(yMax), zMin(zMin), zMax(zMax)
 {
-    this->particle = nullptr;
     this->particleCount  = 0;
     this->totalMass = 0;
     this->xCenter = 0;
     this->yCenter = 0;
     this->zCenter = 0;
+    this->trackMemory();
 };
 
 
@@ -27,12 +30,13 @@ Cell::Cell(const Cell &obj)
     this->zMin = obj.zMin;
     this->zMax = obj.zMax;
 
-    this->particle = obj.particle;
+    this->particles = obj.particles;
     this->particleCount = obj.particleCount;
     this->totalMass = obj.totalMass;
     this->xCenter = obj.xCenter;
     this->yCenter = obj.yCenter;
     this->zCenter = obj.zCenter;
+    this->trackMemory();
 }
 
 
@@ -52,9 +56,16 @@ bool Cell::isInsideCell(float x, float y, float z)
 }
 
 
+bool Cell::isLeaf()
+{
+    return this->children.size() == 0;
+}
+
+
 // Insert the particle in the Cell.
 // This only works if the particle's coordinates fall between the cell boundaries.
 // Otherwise the operation is ignored.
+// A leaf keeps up to LEAF_CAPACITY particles and is split only when one more arrives.
 void Cell::insertParticle(Particle* particle)
 {
     if(!this->isInsideCell(particle->x, particle->y, particle->z))
@@ -62,27 +73,35 @@ void Cell::insertParticle(Particle* particle)
         return;
     }
 
-    if(this->particleCount > 0)
+    if(!this->isLeaf())
     {
-        if(this->particleCount == 1)
+        for(int i=0; i<8; i++)
+        {
+            this->children[i]->insertParticle(particle);
+        }
+    }
+    else if(this->particles.size() < LEAF_CAPACITY || this->xMax - this->xMin < MIN_CELL_SIZE)
+    {
+        this->particles.push_back(particle);
+        this->trackMemory();
+    }
+    else
+    {
+        this->expandChildren();
+        for(int j=0; j<this->particles.size(); j++)
         {
-            this->expandChildren();
             for(int i=0; i<8; i++)
             {
-                this->children[i]->insertParticle(this->particle);
+                this->children[i]->insertParticle(this->particles[j]);
             }
-            this->particle = nullptr;
         }
+        this->particles.clear();
 
         for(int i=0; i<8; i++)
         {
             this->children[i]->insertParticle(particle);
         }
     }
-    else
-    {
-        this->particle = particle;
-    }
 
     this->xCenter = (this->totalMass * this->xCenter + particle->mass * particle->x) / (this->totalMass + particle->mass);
     this->yCenter = (this->totalMass * this->yCenter + particle->mass * particle->y) / (this->totalMass + particle->mass);
@@ -116,26 +135,14 @@ void Cell::expandChildren()
     this->children.push_back(c6);
     this->children.push_back(c7);
     this->children.push_back(c8);
+    this->trackMemory();
 }
 
 
-bool Cell::isFarEnoughFromParticleToUseAsCluster(Particle *particle)
+// Reports the change in the size of the cell and its vectors since the last call.
+void Cell::trackMemory()
 {
-    // Check if it's an internal node.
-    if(this->children.size() > 0)
-    {
-        float s = this->xMax - this->xMin;
-
-        float dx = particle->x - this->xCenter;
-        float dy = particle->y - this->yCenter;
-        float dz = particle->z - this->zCenter;
-        float d = (float)pow(dx*dx + dy*dy + dz*dz, 0.5);
-
-        return (s/d) < OMEGA;
-    }
-        // Otherwise, make sure we're not comparing the particle with itself.
-    else
-    {
-        return particle != this->particle;
-    }
+    long bytes = sizeof(Cell) + this->children.capacity() * sizeof(Cell*) + this->particles.capacity() * sizeof(Particle*);
+    MemoryTracker::allocate(TREE_NODES, bytes - this->trackedBytes);
+    this->trackedBytes = bytes;
 }
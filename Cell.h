@@ -2,6 +2,7 @@
 #define NBODY_CELL_H
 
 #include "Particle.h"
+#include "MemoryTracker.h"
 #include <vector>
 #include <iostream>
 #include <boost/archive/text_oarchive.hpp>
@@ -15,15 +16,19 @@ public:
 
     float xMin, xMax, yMin, yMax, zMin, zMax, xCenter, yCenter, zCenter, totalMass;
     std::vector<Cell*> children;
-    Particle* particle;
+    // Particles held directly by a leaf, at most LEAF_CAPACITY of them.
+    std::vector<Particle*> particles;
     int particleCount;
+    // Bytes of the cell and its vectors reported to the MemoryTracker.
+    long trackedBytes = 0;
 
     void setCoordinates(float, float, float, float, float, float);
     bool isInsideCell(float, float, float);
+    bool isLeaf();
     void insertParticle(Particle*);
     void expandChildren();
     void insertChildren(Cell*, int);
-    bool isFarEnoughFromParticleToUseAsCluster(Particle*);
+    void trackMemory();
 
 
     Cell();
@@ -37,6 +42,7 @@ public:
                 delete this->children[i];
         }
         this->children.clear();
+        MemoryTracker::release(TREE_NODES, this->trackedBytes);
     };
 };
 
@@ -0,0 +1,324 @@
+#include "CompactTree.h"
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+
+// Largest value of a quantized center of mass coordinate.
+static const float QUANTIZATION_STEPS = 65535;
+
+
+template<class T>
+static void write(std::vector<unsigned char>& buffer, T value)
+{
+    size_t offset = buffer.size();
+    buffer.resize(offset + sizeof(T));
+    memcpy(&buffer[offset], &value, sizeof(T));
+}
+
+
+template<class T>
+static T read(const std::vector<unsigned char>& buffer, size_t& offset)
+{
+    T value;
+    memcpy(&value, &buffer[offset], sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+
+// Computes the bounds of the child in the given octant, in the same order used by Cell::expandChildren.
+static void octantBounds(const float* parent, int octant, float* child)
+{
+    for(int axis=0; axis<3; axis++)
+    {
+        float min = parent[axis*2];
+        float max = parent[axis*2 + 1];
+        float half = (min + max) / 2;
+
+        if(octant & (1 << axis))
+        {
+            child[axis*2] = half;
+            child[axis*2 + 1] = max;
+        }
+        else
+        {
+            child[axis*2] = min;
+            child[axis*2 + 1] = half;
+        }
+    }
+}
+
+
+static uint16_t quantize(float value, float min, float max)
+{
+    float q = std::round((value - min) / (max - min) * QUANTIZATION_STEPS);
+    return (uint16_t)std::min(std::max(q, 0.0f), QUANTIZATION_STEPS);
+}
+
+
+static float dequantize(uint16_t value, float min, float max)
+{
+    return min + (max - min) * ((float)value / QUANTIZATION_STEPS);
+}
+
+
+// Lists the children of a serialized cell, in octant order.
+static int childCells(SerializedCell& tree, int cell, int* children)
+{
+    if(tree.isLeaf(cell))
+    {
+        return 0;
+    }
+
+    int count = 0;
+    for(int child = cell + 1; child < tree.serializedCellMatrixInts[cell*SerializedCell::INTS_PER_CELL + 2]; child = tree.serializedCellMatrixInts[child*SerializedCell::INTS_PER_CELL + 2])
+    {
+        children[count++] = child;
+    }
+
+    return count;
+}
+
+
+void CompactTree::encode(SerializedCell& tree, bool quantizeCenters)
+{
+    const int F = SerializedCell::FLOATS_PER_CELL;
+    const int I = SerializedCell::INTS_PER_CELL;
+    float* floats = tree.serializedCellMatrixFloats;
+    int* ints = tree.serializedCellMatrixInts;
+    int cellChildren[8];
+
+    // Breadth first order of the non empty cells. The root is always kept.
+    std::vector<int> order;
+    order.push_back(0);
+
+    for(int i=0; i<order.size(); i++)
+    {
+        int childCount = childCells(tree, order[i], cellChildren);
+        for(int j=0; j<childCount; j++)
+        {
+            if(ints[cellChildren[j]*I + 0] > 0)
+            {
+                order.push_back(cellChildren[j]);
+            }
+        }
+    }
+
+    this->buffer.clear();
+    write<int32_t>(this->buffer, (int32_t)order.size());
+    write<int32_t>(this->buffer, (int32_t)tree.particleIndexCount);
+    write<uint8_t>(this->buffer, quantizeCenters ? 1 : 0);
+    for(int i=0; i<6; i++)
+    {
+        write<float>(this->buffer, floats[i]);
+    }
+
+    for(int i=0, nextChild=1; i<order.size(); i++)
+    {
+        int cell = order[i];
+
+        uint8_t childMask = 0;
+        int childCount = childCells(tree, cell, cellChildren);
+        for(int j=0; j<childCount; j++)
+        {
+            if(ints[cellChildren[j]*I + 0] > 0)
+            {
+                childMask |= 1 << j;
+            }
+        }
+
+        write<uint8_t>(this->buffer, childMask);
+        write<float>(this->buffer, floats[cell*F + 9]);
+
+        if(quantizeCenters)
+        {
+            for(int axis=0; axis<3; axis++)
+            {
+                float min = floats[cell*F + axis*2];
+                float max = floats[cell*F + axis*2 + 1];
+                write<uint16_t>(this->buffer, quantize(floats[cell*F + 6 + axis], min, max));
+            }
+        }
+        else
+        {
+            for(int axis=0; axis<3; axis++)
+            {
+                write<float>(this->buffer, floats[cell*F + 6 + axis]);
+            }
+        }
+
+        if(childMask != 0)
+        {
+            // The non empty children are stored next to each other, starting at nextChild.
+            write<uint32_t>(this->buffer, (uint32_t)nextChild);
+            for(int j=0; j<8; j++)
+            {
+                if(childMask & (1 << j))
+                {
+                    nextChild++;
+                }
+            }
+        }
+        else
+        {
+            // Leaves carry their particle indices inline. The count takes 32 bits, since leaves which stopped
+            // splitting at MIN_CELL_SIZE can hold any number of particles.
+            int particleCount = ints[cell*I + 0];
+
+            write<uint32_t>(this->buffer, (uint32_t)particleCount);
+            for(int j=0; j<particleCount; j++)
+            {
+                write<int32_t>(this->buffer, tree.serializedParticleIndices[ints[cell*I + 1] + j]);
+            }
+        }
+    }
+
+    this->trackMemory();
+}
+
+
+// Cells read from the compact format, in breadth first order.
+struct DecodedCell {
+    float bounds[6];
+    float center[3];
+    float totalMass;
+    uint8_t childMask;
+    int firstChild;
+    int particleCount;
+    int particleOffset;
+};
+
+
+// Writes the cell and its subtree to the serialized tree in pre-order, re-creating the empty children.
+static void emitPreOrder(SerializedCell& tree, std::vector<DecodedCell>& cells, int index, int& nextIndex)
+{
+    const int F = SerializedCell::FLOATS_PER_CELL;
+    const int I = SerializedCell::INTS_PER_CELL;
+    DecodedCell& cell = cells[index];
+
+    int serializedIndex = nextIndex++;
+    float* floats = &tree.serializedCellMatrixFloats[serializedIndex*F];
+    int* ints = &tree.serializedCellMatrixInts[serializedIndex*I];
+
+    for(int i=0; i<6; i++)
+    {
+        floats[i] = cell.bounds[i];
+    }
+    floats[6] = cell.center[0];
+    floats[7] = cell.center[1];
+    floats[8] = cell.center[2];
+    floats[9] = cell.totalMass;
+
+    int particleCount = cell.particleCount;
+
+    for(int j=0, k=0; j<8 && cell.childMask != 0; j++)
+    {
+        int child = nextIndex;
+
+        if(cell.childMask & (1 << j))
+        {
+            emitPreOrder(tree, cells, cell.firstChild + k, nextIndex);
+            particleCount += tree.serializedCellMatrixInts[child*I + 0];
+            k++;
+        }
+        else
+        {
+            nextIndex++;
+            float* childFloats = &tree.serializedCellMatrixFloats[child*F];
+            int* childInts = &tree.serializedCellMatrixInts[child*I];
+
+            octantBounds(cell.bounds, j, childFloats);
+            childFloats[6] = childFloats[7] = childFloats[8] = childFloats[9] = 0;
+            childInts[0] = 0;
+            childInts[1] = -1;
+            childInts[2] = child + 1;
+        }
+    }
+
+    ints[0] = particleCount;
+    ints[1] = cell.particleCount > 0 ? cell.particleOffset : -1;
+    ints[2] = nextIndex;
+}
+
+
+void CompactTree::decode(SerializedCell& tree)
+{
+    size_t offset = 0;
+    int encodedCellCount = read<int32_t>(this->buffer, offset);
+    int particleIndexCount = read<int32_t>(this->buffer, offset);
+    bool quantizedCenters = read<uint8_t>(this->buffer, offset) != 0;
+
+    std::vector<DecodedCell> cells(encodedCellCount);
+    for(int i=0; i<6; i++)
+    {
+        cells[0].bounds[i] = read<float>(this->buffer, offset);
+    }
+
+    std::vector<int> particleIndices(particleIndexCount);
+
+    // Every cell but the root is one of the 8 children of an internal cell.
+    long internalCellCount = 0;
+
+    for(int i=0, particleOffset=0; i<encodedCellCount; i++)
+    {
+        DecodedCell& cell = cells[i];
+        cell.childMask = read<uint8_t>(this->buffer, offset);
+        cell.totalMass = read<float>(this->buffer, offset);
+
+        for(int axis=0; axis<3; axis++)
+        {
+            if(quantizedCenters)
+            {
+                cell.center[axis] = dequantize(read<uint16_t>(this->buffer, offset), cell.bounds[axis*2], cell.bounds[axis*2 + 1]);
+            }
+            else
+            {
+                cell.center[axis] = read<float>(this->buffer, offset);
+            }
+        }
+
+        cell.particleCount = 0;
+        cell.particleOffset = -1;
+        cell.firstChild = -1;
+
+        if(cell.childMask != 0)
+        {
+            internalCellCount++;
+            cell.firstChild = read<uint32_t>(this->buffer, offset);
+
+            for(int j=0, k=0; j<8; j++)
+            {
+                if(cell.childMask & (1 << j))
+                {
+                    octantBounds(cell.bounds, j, cells[cell.firstChild + k].bounds);
+                    k++;
+                }
+            }
+        }
+        else
+        {
+            cell.particleCount = read<uint32_t>(this->buffer, offset);
+            cell.particleOffset = particleOffset;
+            for(int j=0; j<cell.particleCount; j++, particleOffset++)
+            {
+                particleIndices[particleOffset] = read<int32_t>(this->buffer, offset);
+            }
+        }
+    }
+
+    tree.allocate(1 + 8 * internalCellCount, particleIndexCount);
+    std::copy(particleIndices.begin(), particleIndices.end(), tree.serializedParticleIndices);
+
+    int nextIndex = 0;
+    emitPreOrder(tree, cells, 0, nextIndex);
+}
+
+
+// Reports the change in the capacity of the buffer since the last call.
+void CompactTree::trackMemory()
+{
+    MemoryTracker::allocate(COMMUNICATION_BUFFERS, (long)this->buffer.capacity() - this->trackedBytes);
+    this->trackedBytes = this->buffer.capacity();
+}
@@ -0,0 +1,35 @@
+#ifndef NBODY_COMPACTTREE_H
+#define NBODY_COMPACTTREE_H
+
+#include "SerializedCell.h"
+#include "MemoryTracker.h"
+#include <vector>
+
+class SerializedCell;
+
+
+// Compact wire format of a serialized tree, used for the tree broadcast.
+//
+// Cells are stored breadth first. Their bounds are not stored, they follow from the root bounds and
+// the octant path to the cell. Empty children are not stored either, every cell only keeps a bitmask of
+// its non empty children and the index of the first of them.
+// Centers of mass are either stored as floats or quantized to 16 bits per axis, relative to the cell bounds.
+class CompactTree {
+public:
+    std::vector<unsigned char> buffer;
+    // Bytes of the buffer reported to the MemoryTracker.
+    long trackedBytes = 0;
+
+    void encode(SerializedCell&, bool);
+    void decode(SerializedCell&);
+    void trackMemory();
+
+    CompactTree(){};
+    ~CompactTree()
+    {
+        MemoryTracker::release(COMMUNICATION_BUFFERS, this->trackedBytes);
+    };
+};
+
+
+#endif
@@ -0,0 +1,356 @@
+#include "ConcurrentTree.h"
+#include "MemoryTracker.h"
+#include <algorithm>
+#include <vector>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+ConcurrentTree::~ConcurrentTree()
+{
+    this->release();
+}
+
+
+void ConcurrentTree::release()
+{
+    MemoryTracker::release(TREE_NODES, this->capacity * (6 * sizeof(float) + sizeof(std::atomic<int>) + 4 * sizeof(int) + 4 * sizeof(float)) + this->particleTotal * sizeof(int));
+
+    delete[] this->bounds;
+    delete[] this->state;
+    delete[] this->firstChild;
+    delete[] this->head;
+    delete[] this->depth;
+    delete[] this->moments;
+    delete[] this->particleCount;
+    delete[] this->next;
+    this->capacity = 0;
+    this->particleTotal = 0;
+}
+
+
+void ConcurrentTree::allocate(long capacity, long particleTotal)
+{
+    this->release();
+
+    this->capacity = capacity;
+    this->particleTotal = particleTotal;
+    this->bounds = new float[capacity * 6];
+    this->state = new std::atomic<int>[capacity];
+    this->firstChild = new int[capacity];
+    this->head = new int[capacity];
+    this->depth = new int[capacity];
+    this->moments = new float[capacity * 4];
+    this->particleCount = new int[capacity];
+    this->next = new int[particleTotal];
+
+    MemoryTracker::allocate(TREE_NODES, capacity * (6 * sizeof(float) + sizeof(std::atomic<int>) + 4 * sizeof(int) + 4 * sizeof(float)) + particleTotal * sizeof(int));
+}
+
+
+// Child of the node holding the particle, in the order of Cell::expandChildren.
+// Cells hold the coordinates in (min, max], so a particle on the middle plane goes to the lower child.
+int ConcurrentTree::octant(int node, Particle* particle)
+{
+    float* nodeBounds = &this->bounds[node * 6];
+    int octant = 0;
+
+    if(particle->x > (nodeBounds[0] + nodeBounds[1]) / 2) octant |= 1;
+    if(particle->y > (nodeBounds[2] + nodeBounds[3]) / 2) octant |= 2;
+    if(particle->z > (nodeBounds[4] + nodeBounds[5]) / 2) octant |= 4;
+
+    return octant;
+}
+
+
+// Takes 8 empty leaves from the pool for the children of the node. Returns -1 when the pool is exhausted.
+// The children are only seen by other threads once the node is marked as SPLIT.
+long ConcurrentTree::newChildren(int node)
+{
+    long child = this->nodeCount.fetch_add(8);
+    if(child + 8 > this->capacity)
+    {
+        this->overflow = true;
+        return -1;
+    }
+
+    float* nodeBounds = &this->bounds[node * 6];
+
+    for(int i=0; i<8; i++)
+    {
+        float* childBounds = &this->bounds[(child + i) * 6];
+
+        for(int axis=0; axis<3; axis++)
+        {
+            float min = nodeBounds[axis*2];
+            float max = nodeBounds[axis*2 + 1];
+            float half = (min + max) / 2;
+
+            childBounds[axis*2] = (i & (1 << axis)) ? half : min;
+            childBounds[axis*2 + 1] = (i & (1 << axis)) ? max : half;
+        }
+
+        this->state[child + i].store(0, std::memory_order_relaxed);
+        this->firstChild[child + i] = -1;
+        this->head[child + i] = -1;
+        this->depth[child + i] = this->depth[node] + 1;
+    }
+
+    return child;
+}
+
+
+// Inserts the particle, if it falls inside the root.
+// Like Cell::insertParticle, a leaf is split only when it overflows its capacity, and never below MIN_CELL_SIZE.
+void ConcurrentTree::insert(int index)
+{
+    Particle* particle = &this->particleVector[index];
+    float* rootBounds = this->bounds;
+
+    if(!(rootBounds[0] < particle->x && particle->x <= rootBounds[1]
+         && rootBounds[2] < particle->y && particle->y <= rootBounds[3]
+         && rootBounds[4] < particle->z && particle->z <= rootBounds[5]))
+    {
+        return;
+    }
+
+    int node = 0;
+    int spins = 0;
+
+    while(true)
+    {
+        int nodeState = this->state[node].load(std::memory_order_acquire);
+
+        if(nodeState == SPLIT)
+        {
+            node = this->firstChild[node] + this->octant(node, particle);
+            continue;
+        }
+
+        // Back off while another thread holds the leaf's lock, and yield the core once the wait gets long, since the
+        // holder may have been descheduled when the threads outnumber the cores.
+        if(nodeState == LOCKED)
+        {
+            if(++spins < SPINS_BEFORE_YIELD)
+            {
+#if defined(__x86_64__) || defined(__i386__)
+                _mm_pause();
+#endif
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+            continue;
+        }
+
+        // Retry if another thread took the lock first.
+        if(!this->state[node].compare_exchange_weak(nodeState, LOCKED, std::memory_order_acquire))
+        {
+            continue;
+        }
+
+        long child = -1;
+        if(nodeState < this->leafCapacity || this->bounds[node*6 + 1] - this->bounds[node*6] < MIN_CELL_SIZE || (child = this->newChildren(node)) < 0)
+        {
+            this->next[index] = this->head[node];
+            this->head[node] = index;
+            this->state[node].store(nodeState + 1, std::memory_order_release);
+            return;
+        }
+
+        // Move the leaf's particles to the new children, then publish them. The particle is inserted by the next iteration.
+        for(int j = this->head[node]; j != -1; )
+        {
+            int nextParticle = this->next[j];
+            long leaf = child + this->octant(node, &this->particleVector[j]);
+
+            this->next[j] = this->head[leaf];
+            this->head[leaf] = j;
+            this->state[leaf].store(this->state[leaf].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+            j = nextParticle;
+        }
+
+        this->head[node] = -1;
+        this->firstChild[node] = (int)child;
+        this->state[node].store(SPLIT, std::memory_order_release);
+    }
+}
+
+
+// Computes the mass moments of every node, one level at a time from the deepest, with the nodes of a level in parallel.
+// Leaves sort their particles by index first, so that the tree doesn't depend on the order of the insertions.
+void ConcurrentTree::computeMoments()
+{
+    long nodeCount = this->nodeCount;
+    int maxDepth = 0;
+    for(long i=0; i<nodeCount; i++)
+    {
+        maxDepth = std::max(maxDepth, this->depth[i]);
+    }
+
+    // Nodes grouped by depth.
+    std::vector<long> levelStart(maxDepth + 2, 0);
+    std::vector<int> levelNodes(nodeCount);
+    for(long i=0; i<nodeCount; i++)
+    {
+        levelStart[this->depth[i] + 1]++;
+    }
+    for(int d=0; d<=maxDepth; d++)
+    {
+        levelStart[d + 1] += levelStart[d];
+    }
+    std::vector<long> levelFill(levelStart.begin(), levelStart.end() - 1);
+    for(long i=0; i<nodeCount; i++)
+    {
+        levelNodes[levelFill[this->depth[i]]++] = (int)i;
+    }
+
+    for(int d=maxDepth; d>=0; d--)
+    {
+        #pragma omp parallel
+        {
+            std::vector<int> leafParticles;
+
+            #pragma omp for schedule(dynamic, 64)
+            for(long k=levelStart[d]; k<levelStart[d + 1]; k++)
+            {
+                int node = levelNodes[k];
+                double mass = 0, x = 0, y = 0, z = 0;
+                int count = 0;
+
+                if(this->state[node] == SPLIT)
+                {
+                    for(int i=0; i<8; i++)
+                    {
+                        int child = this->firstChild[node] + i;
+                        float childMass = this->moments[child*4 + 3];
+
+                        mass += childMass;
+                        x += (double)childMass * this->moments[child*4];
+                        y += (double)childMass * this->moments[child*4 + 1];
+                        z += (double)childMass * this->moments[child*4 + 2];
+                        count += this->particleCount[child];
+                    }
+                }
+                else
+                {
+                    leafParticles.clear();
+                    for(int j = this->head[node]; j != -1; j = this->next[j])
+                    {
+                        leafParticles.push_back(j);
+                    }
+                    std::sort(leafParticles.begin(), leafParticles.end());
+
+                    // Relink the list in index order.
+                    this->head[node] = -1;
+                    for(long j = (long)leafParticles.size() - 1; j >= 0; j--)
+                    {
+                        this->next[leafParticles[j]] = this->head[node];
+                        this->head[node] = leafParticles[j];
+
+                        Particle* particle = &this->particleVector[leafParticles[j]];
+                        mass += particle->mass;
+                        x += (double)particle->mass * particle->x;
+                        y += (double)particle->mass * particle->y;
+                        z += (double)particle->mass * particle->z;
+                    }
+                    count = (int)leafParticles.size();
+                }
+
+                this->moments[node*4] = mass > 0 ? (float)(x / mass) : 0;
+                this->moments[node*4 + 1] = mass > 0 ? (float)(y / mass) : 0;
+                this->moments[node*4 + 2] = mass > 0 ? (float)(z / mass) : 0;
+                this->moments[node*4 + 3] = (float)mass;
+                this->particleCount[node] = count;
+            }
+        }
+    }
+}
+
+
+// Builds the tree of the particles inside the given bounds, with all the threads of the process.
+// When indices are given, only the count particles they list are inserted, out of the n of the vector.
+void ConcurrentTree::build(float xMin, float xMax, float yMin, float yMax, float zMin, float zMax, Particle* particles, long n, const int* indices, long count)
+{
+    this->particleVector = particles;
+    long inserted = indices != nullptr ? count : n;
+
+    // Splitting a leaf takes 8 nodes, and there are at most about 2 leaves per leafCapacity particles,
+    // unless the particles are clustered. The pool is grown and the build restarted when that's not enough.
+    long capacity = std::max(this->capacity, 1 + 16 * (inserted / this->leafCapacity + 1));
+
+    do
+    {
+        if(capacity > this->capacity || n > this->particleTotal)
+        {
+            this->allocate(capacity, n);
+        }
+
+        float rootBounds[6] = {xMin, xMax, yMin, yMax, zMin, zMax};
+        std::copy(rootBounds, rootBounds + 6, this->bounds);
+        this->state[0] = 0;
+        this->firstChild[0] = -1;
+        this->head[0] = -1;
+        this->depth[0] = 0;
+        this->nodeCount = 1;
+        this->overflow = false;
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(long i=0; i<inserted; i++)
+        {
+            this->insert(indices != nullptr ? indices[i] : (int)i);
+        }
+
+        capacity *= 2;
+    }
+    while(this->overflow);
+
+    this->computeMoments();
+}
+
+
+// Writes the node and its subtree in pre-order, in the same layout as SerializedCell::serializeTree.
+void ConcurrentTree::serializeNode(SerializedCell& tree, int node, long& cell, long& particleOffset)
+{
+    long index = cell++;
+    float* floats = &tree.serializedCellMatrixFloats[index * SerializedCell::FLOATS_PER_CELL];
+    int* ints = &tree.serializedCellMatrixInts[index * SerializedCell::INTS_PER_CELL];
+
+    std::copy(&this->bounds[node * 6], &this->bounds[node * 6] + 6, floats);
+    std::copy(&this->moments[node * 4], &this->moments[node * 4] + 4, &floats[6]);
+
+    ints[0] = this->particleCount[node];
+    ints[1] = -1;
+
+    if(this->state[node] == SPLIT)
+    {
+        for(int i=0; i<8; i++)
+        {
+            this->serializeNode(tree, this->firstChild[node] + i, cell, particleOffset);
+        }
+    }
+    else if(this->head[node] != -1)
+    {
+        ints[1] = (int)particleOffset;
+        for(int j = this->head[node]; j != -1; j = this->next[j])
+        {
+            tree.serializedParticleIndices[particleOffset++] = j;
+        }
+    }
+
+    ints[2] = (int)cell;
+}
+
+
+void ConcurrentTree::serialize(SerializedCell& tree)
+{
+    tree.allocate(this->nodeCount, this->particleCount[0]);
+
+    long cell = 0, particleOffset = 0;
+    this->serializeNode(tree, 0, cell, particleOffset);
+}
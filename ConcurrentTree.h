@@ -0,0 +1,68 @@
+#ifndef NBODY_CONCURRENTTREE_H
+#define NBODY_CONCURRENTTREE_H
+
+#include "common.h"
+#include "Particle.h"
+#include "SerializedCell.h"
+#include <atomic>
+
+class Particle;
+class SerializedCell;
+
+
+// Octree built by all the threads of a process together, with the same cells as inserting the particles in a Cell.
+//
+// The nodes live in a preallocated pool. Every node has a state: the number of particles of a leaf, SPLIT once the
+// node has children, or LOCKED while a thread adds a particle to the leaf or splits it. Threads lock a leaf with a
+// compare and swap on its state, and the others reaching it spin until it is released, yielding their core after
+// SPINS_BEFORE_YIELD tries, so this is fine-grained locking per leaf rather than a lock-free build. Splitting a leaf takes 8 consecutive nodes from the pool with an atomic add.
+// Leaves keep their particles in a linked list through the next array.
+// The mass moments are computed after the insertions, level by level from the deepest one.
+class ConcurrentTree {
+public:
+    static const int SPLIT = -1;
+    static const int LOCKED = -2;
+    // Pauses of a thread waiting for a leaf before it starts yielding its core.
+    static const int SPINS_BEFORE_YIELD = 64;
+
+    Particle* particleVector = nullptr;
+    long particleTotal = 0;
+    // Particles a leaf holds before it is split.
+    int leafCapacity = LEAF_CAPACITY;
+
+    long capacity = 0;
+    std::atomic<long> nodeCount;
+    // Set when the pool ran out of nodes, the build is then done again with a larger pool.
+    std::atomic<bool> overflow;
+
+    // Per node: xMin, xMax, yMin, yMax, zMin, zMax.
+    float* bounds = nullptr;
+    std::atomic<int>* state = nullptr;
+    int* firstChild = nullptr;
+    int* head = nullptr;
+    int* depth = nullptr;
+    // Per node: xCenter, yCenter, zCenter, totalMass.
+    float* moments = nullptr;
+    int* particleCount = nullptr;
+    // Next particle of the same leaf, per particle.
+    int* next = nullptr;
+
+    void build(float, float, float, float, float, float, Particle*, long, const int* = nullptr, long = 0);
+    void serialize(SerializedCell&);
+
+    ConcurrentTree() : nodeCount(0), overflow(false) {};
+    ConcurrentTree(const ConcurrentTree&) = delete;
+    ~ConcurrentTree();
+
+private:
+    void allocate(long, long);
+    void release();
+    int octant(int, Particle*);
+    long newChildren(int);
+    void insert(int);
+    void computeMoments();
+    void serializeNode(SerializedCell&, int, long&, long&);
+};
+
+
+#endif
@@ -0,0 +1,90 @@
+#include "DomainDecomposition.h"
+#include <algorithm>
+#include <utility>
+
+
+// Key of the particle along the Morton curve, on a grid of 2^21 cells per axis over the bounds.
+// Particles out of the bounds get the key of the nearest cell.
+uint64_t DomainDecomposition::key(Particle& particle, float* bounds)
+{
+    const float cells = (float)(1 << 21);
+    float coordinates[3] = {particle.x, particle.y, particle.z};
+    uint32_t gridPosition[3];
+
+    for(int axis=0; axis<3; axis++)
+    {
+        float position = (coordinates[axis] - bounds[2 * axis]) / (bounds[2 * axis + 1] - bounds[2 * axis]) * cells;
+        gridPosition[axis] = (uint32_t)std::min(std::max(position, 0.0f), cells - 1);
+    }
+
+    return mortonCode(gridPosition[0], gridPosition[1], gridPosition[2]);
+}
+
+
+// Process owning the key.
+int DomainDecomposition::owner(uint64_t key)
+{
+    return (int)(std::upper_bound(this->splitters.begin(), this->splitters.end(), key) - this->splitters.begin());
+}
+
+
+// Moves the splitters so that every process gets about the same number of the particles, with the keys over the bounds.
+// Collective over the communicator.
+void DomainDecomposition::balance(Particle* particles, long count, float* bounds, MPI_Comm communicator)
+{
+    int processCount;
+    MPI_Comm_size(communicator, &processCount);
+
+    // Evenly spaced samples of this process' particles, weighted by the particles they stand for.
+    long stride = std::max(1L, count / DOMAIN_SAMPLES);
+    std::vector<uint64_t> keys;
+    for(long i = stride / 2; i < count; i += stride)
+    {
+        keys.push_back(key(particles[i], bounds));
+    }
+    std::vector<double> weights(keys.size(), keys.size() > 0 ? (double)count / keys.size() : 0);
+
+    int sampleCount = (int)keys.size();
+    std::vector<int> sizes(processCount), offsets(processCount, 0);
+    MPI_Allgather(&sampleCount, 1, MPI_INT, sizes.data(), 1, MPI_INT, communicator);
+    for(int i=1; i<processCount; i++)
+    {
+        offsets[i] = offsets[i - 1] + sizes[i - 1];
+    }
+
+    long totalSamples = offsets[processCount - 1] + sizes[processCount - 1];
+    if(totalSamples == 0)
+    {
+        return;
+    }
+
+    std::vector<uint64_t> allKeys(totalSamples);
+    std::vector<double> allWeights(totalSamples);
+    MPI_Allgatherv(keys.data(), sampleCount, MPI_UINT64_T, allKeys.data(), sizes.data(), offsets.data(), MPI_UINT64_T, communicator);
+    MPI_Allgatherv(weights.data(), sampleCount, MPI_DOUBLE, allWeights.data(), sizes.data(), offsets.data(), MPI_DOUBLE, communicator);
+
+    std::vector<std::pair<uint64_t, double>> samples(totalSamples);
+    double totalWeight = 0;
+    for(long i=0; i<totalSamples; i++)
+    {
+        samples[i] = std::make_pair(allKeys[i], allWeights[i]);
+        totalWeight += allWeights[i];
+    }
+    std::sort(samples.begin(), samples.end());
+
+    // Domain k starts at the first sample reaching k / processCount of the total weight.
+    // Every process sorts the same samples, so they all agree on the splitters.
+    this->splitters.assign(processCount - 1, UINT64_MAX);
+    double weight = 0;
+    int domain = 1;
+
+    for(long i=0; i<totalSamples && domain < processCount; i++)
+    {
+        while(domain < processCount && weight >= totalWeight * domain / processCount)
+        {
+            this->splitters[domain - 1] = samples[i].first;
+            domain++;
+        }
+        weight += samples[i].second;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef NBODY_DOMAINDECOMPOSITION_H
+#define NBODY_DOMAINDECOMPOSITION_H
+
+#include "common.h"
+#include "Particle.h"
+#include <mpi.h>
+#include <vector>
+
+class Particle;
+
+
+// Split of the space among the processes, for the distributed ownership of the particles.
+//
+// Particles are ordered along a Morton curve over the root cell, and every process owns a contiguous range of
+// keys, so that its domain stays compact. The ranges are balanced from DOMAIN_SAMPLES keys sampled by every process,
+// each standing for an equal share of that process' particles.
+class DomainDecomposition {
+public:
+    // First key of every domain but the first one, in increasing order.
+    std::vector<uint64_t> splitters;
+
+    static uint64_t key(Particle&, float*);
+    int owner(uint64_t);
+    void balance(Particle*, long, float*, MPI_Comm);
+};
+
+
+#endif
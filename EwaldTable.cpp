@@ -0,0 +1,170 @@
+#include "EwaldTable.h"
+#include "common.h"
+#include <cmath>
+#include <algorithm>
+
+
+// Splitting between the real space and the reciprocal space sums, in units of the inverse box size.
+static const double ALPHA = 2;
+// Images and wave vectors summed along every axis, on both sides. Terms below about 1e-10 are skipped.
+static const int IMAGE_RANGE = 4;
+static const double MAX_SCREENED_DISTANCE = 4.5 / ALPHA;
+static const int MAX_WAVE_VECTOR = 10;
+
+
+// Force and potential corrections at the separation x of a unit box, for a unit mass and a unit gravitational constant.
+// The force is on the particle, x pointing from the mass to the particle.
+static void ewaldCorrection(const double* x, double* force, double& potential)
+{
+    double r = std::sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]);
+
+    // The nearest image is already interacted with directly, so its Newtonian force and potential are taken out.
+    // At the origin, the force correction vanishes by symmetry, and the potential one goes to its limit.
+    if(r == 0)
+    {
+        force[0] = force[1] = force[2] = 0;
+        potential = 2.8372975;
+        return;
+    }
+
+    force[0] = x[0] / (r*r*r);
+    force[1] = x[1] / (r*r*r);
+    force[2] = x[2] / (r*r*r);
+    potential = 1 / r + M_PI / (ALPHA * ALPHA);
+
+    for(int i = -IMAGE_RANGE; i <= IMAGE_RANGE; i++)
+    {
+        for(int j = -IMAGE_RANGE; j <= IMAGE_RANGE; j++)
+        {
+            for(int k = -IMAGE_RANGE; k <= IMAGE_RANGE; k++)
+            {
+                // Real space: the images screened by erfc.
+                double d[3] = {x[0] - i, x[1] - j, x[2] - k};
+                double distance = std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+
+                if(distance < MAX_SCREENED_DISTANCE)
+                {
+                    double screening = std::erfc(ALPHA * distance) + 2 * ALPHA * distance / std::sqrt(M_PI) * std::exp(-ALPHA * ALPHA * distance * distance);
+                    for(int axis=0; axis<3; axis++)
+                    {
+                        force[axis] -= d[axis] / (distance * distance * distance) * screening;
+                    }
+                    potential -= std::erfc(ALPHA * distance) / distance;
+                }
+
+                // Reciprocal space: the smooth part, from the wave vectors but the zero one, which the background cancels.
+                int h2 = i*i + j*j + k*k;
+                if(h2 > 0 && h2 <= MAX_WAVE_VECTOR)
+                {
+                    double phase = 2 * M_PI * (i * x[0] + j * x[1] + k * x[2]);
+                    double damping = std::exp(-M_PI * M_PI * h2 / (ALPHA * ALPHA));
+
+                    double amplitude = 2.0 / h2 * damping * std::sin(phase);
+                    force[0] -= i * amplitude;
+                    force[1] -= j * amplitude;
+                    force[2] -= k * amplitude;
+                    potential -= damping * std::cos(phase) / (M_PI * h2);
+                }
+            }
+        }
+    }
+}
+
+
+// Tabulates the corrections on size + 1 points per axis from 0 to half the box. Done once, with all the threads.
+void EwaldTable::compute(int size, float boxSize)
+{
+    this->size = size;
+    this->boxSize = boxSize;
+    int points = size + 1;
+    this->table.assign((long)points * points * points * 4, 0);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(long index=0; index<(long)points * points * points; index++)
+    {
+        double x[3] = {0.5 * (index % points) / size, 0.5 * (index / points % points) / size, 0.5 * (index / points / points) / size};
+        double force[3], potential;
+        ewaldCorrection(x, force, potential);
+
+        for(int axis=0; axis<3; axis++)
+        {
+            this->table[4 * index + axis] = (float)force[axis];
+        }
+        this->table[4 * index + 3] = (float)potential;
+    }
+}
+
+
+// Corrections of a unit mass at the nearest image separation (dx, dy, dz), pointing from the mass to the particle,
+// for a unit gravitational constant. The force is written to force, and the potential to potential.
+void EwaldTable::correction(float dx, float dy, float dz, float* force, float& potential)
+{
+    float d[3] = {dx, dy, dz};
+    int cell[3];
+    float weight[3];
+    int points = this->size + 1;
+
+    for(int axis=0; axis<3; axis++)
+    {
+        float u = std::fabs(d[axis]) / this->boxSize * 2 * this->size;
+        u = std::fmin(u, this->size - 1e-3f);
+        cell[axis] = (int)u;
+        weight[axis] = u - cell[axis];
+    }
+
+    float values[4] = {0, 0, 0, 0};
+    for(int corner=0; corner<8; corner++)
+    {
+        int i = cell[0] + (corner & 1), j = cell[1] + (corner >> 1 & 1), k = cell[2] + (corner >> 2);
+        float w = ((corner & 1) ? weight[0] : 1 - weight[0]) * ((corner >> 1 & 1) ? weight[1] : 1 - weight[1]) * ((corner >> 2) ? weight[2] : 1 - weight[2]);
+        const float* point = &this->table[4 * (((long)k * points + j) * points + i)];
+
+        for(int v=0; v<4; v++)
+        {
+            values[v] += w * point[v];
+        }
+    }
+
+    // Back from the unit box, with the signs of the separation.
+    float scale = 1 / (this->boxSize * this->boxSize);
+    for(int axis=0; axis<3; axis++)
+    {
+        force[axis] = values[axis] * scale * (d[axis] < 0 ? -1 : 1);
+    }
+    potential = values[3] / this->boxSize;
+}
+
+
+// Largest error of the interpolated force against the direct sum, at samples points spread over the whole box in all
+// the octants, relative to the largest force of the samples. Off the axes and the grid, where the signs and the
+// interpolation are exercised.
+double EwaldTable::check(int samples)
+{
+    double largestError = 0, largestForce = 0;
+
+    for(int sample=0; sample<samples; sample++)
+    {
+        float d[3];
+        double x[3];
+        for(int axis=0; axis<3; axis++)
+        {
+            d[axis] = (randUniform(SEED, 3 * sample + axis) - 0.5f) * this->boxSize;
+            x[axis] = std::fabs(d[axis]) / this->boxSize;
+        }
+
+        double exact[3], exactPotential;
+        ewaldCorrection(x, exact, exactPotential);
+
+        float force[3], potential;
+        this->correction(d[0], d[1], d[2], force, potential);
+
+        for(int axis=0; axis<3; axis++)
+        {
+            double expected = exact[axis] * (d[axis] < 0 ? -1 : 1) / (this->boxSize * this->boxSize);
+            largestError = std::max(largestError, std::fabs(force[axis] - expected));
+            largestForce = std::max(largestForce, std::fabs(expected));
+        }
+    }
+
+    return largestForce > 0 ? largestError / largestForce : 0;
+}
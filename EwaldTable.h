@@ -0,0 +1,27 @@
+#ifndef NBODY_EWALDTABLE_H
+#define NBODY_EWALDTABLE_H
+
+#include <vector>
+
+
+// Correction of the force and potential of a point mass in a periodic box, for all its images but the nearest one and
+// for the uniform background which keeps the box neutral, computed with the Ewald summation.
+//
+// The correction is smooth, so it is tabulated once for a unit mass in a unit box, on a grid over the octant of
+// separations within half the box, and trilinearly interpolated. The force correction is odd along every axis and the
+// potential one even, which covers the other octants.
+class EwaldTable {
+public:
+    // Per grid point, x fastest: the force correction along x, y and z, then the potential correction.
+    std::vector<float> table;
+    // Intervals of the grid per axis.
+    int size = 0;
+    float boxSize = 1;
+
+    void compute(int, float);
+    void correction(float, float, float, float*, float&);
+    double check(int);
+};
+
+
+#endif
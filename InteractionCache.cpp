@@ -0,0 +1,154 @@
+#include "InteractionCache.h"
+#include <cmath>
+#include <algorithm>
+
+
+// Builds the lists of the particles [first, last) from the tree.
+void InteractionCache::build(SerializedCell& tree, long first, long last)
+{
+    const int I = SerializedCell::INTS_PER_CELL;
+    Particle* particles = tree.particleVector;
+
+    this->particleVector = particles;
+    this->first = first;
+    this->last = last;
+    this->groupOf.assign(last - first, -1);
+
+    // Members of every group, leaves first.
+    std::vector<std::vector<int>> groups;
+    for(long cell=0; cell<tree.cellCount; cell++)
+    {
+        int* cellInts = &tree.serializedCellMatrixInts[cell * I];
+        if(!tree.isLeaf(cell) || cellInts[0] == 0)
+        {
+            continue;
+        }
+
+        std::vector<int> members;
+        for(int j=0; j<cellInts[0]; j++)
+        {
+            int particleIndex = tree.serializedParticleIndices[cellInts[1] + j];
+            if(first <= particleIndex && particleIndex < last)
+            {
+                this->groupOf[particleIndex - first] = (int)groups.size();
+                members.push_back(particleIndex);
+            }
+        }
+
+        if(members.size() > 0)
+        {
+            groups.push_back(members);
+        }
+    }
+
+    for(long i=first; i<last; i++)
+    {
+        if(this->groupOf[i - first] == -1)
+        {
+            this->groupOf[i - first] = (int)groups.size();
+            groups.push_back(std::vector<int>(1, (int)i));
+        }
+    }
+
+    std::vector<std::vector<int>> far(groups.size()), near(groups.size());
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(long g=0; g<(long)groups.size(); g++)
+    {
+        // Bounding sphere of the group, and the smallest acceleration of its particles.
+        float min[3] = {particles[groups[g][0]].x, particles[groups[g][0]].y, particles[groups[g][0]].z};
+        float max[3] = {min[0], min[1], min[2]};
+        float acceleration = particles[groups[g][0]].acceleration;
+        for(int j=1; j<groups[g].size(); j++)
+        {
+            Particle* particle = &particles[groups[g][j]];
+            acceleration = std::min(acceleration, particle->acceleration);
+            min[0] = std::min(min[0], particle->x); max[0] = std::max(max[0], particle->x);
+            min[1] = std::min(min[1], particle->y); max[1] = std::max(max[1], particle->y);
+            min[2] = std::min(min[2], particle->z); max[2] = std::max(max[2], particle->z);
+        }
+
+        float center[3] = {(min[0] + max[0]) / 2, (min[1] + max[1]) / 2, (min[2] + max[2]) / 2};
+        float radius = std::sqrt((max[0] - min[0]) * (max[0] - min[0]) + (max[1] - min[1]) * (max[1] - min[1]) + (max[2] - min[2]) * (max[2] - min[2])) / 2;
+        radius += INTERACTION_LIST_MARGIN;
+
+        long cell = 0;
+        while(cell < tree.cellCount)
+        {
+            int* cellInts = &tree.serializedCellMatrixInts[cell * I];
+
+            if(cellInts[0] == 0)
+            {
+                cell = cellInts[2];
+            }
+            else if(tree.isFarEnoughFromSphereToUseAsCluster(cell, center, radius, acceleration))
+            {
+                far[g].push_back((int)cell);
+                cell = cellInts[2];
+            }
+            else if(tree.isLeaf(cell))
+            {
+                for(int j=0; j<cellInts[0]; j++)
+                {
+                    near[g].push_back(tree.serializedParticleIndices[cellInts[1] + j]);
+                }
+                cell = cellInts[2];
+            }
+            else
+            {
+                cell++;
+            }
+        }
+    }
+
+    this->farStart.assign(1, 0);
+    this->nearStart.assign(1, 0);
+    this->farCells.clear();
+    this->nearParticles.clear();
+
+    for(long g=0; g<(long)groups.size(); g++)
+    {
+        this->farCells.insert(this->farCells.end(), far[g].begin(), far[g].end());
+        this->nearParticles.insert(this->nearParticles.end(), near[g].begin(), near[g].end());
+        this->farStart.push_back(this->farCells.size());
+        this->nearStart.push_back(this->nearParticles.size());
+    }
+
+    this->buildPositions.resize(3 * (last - first));
+    for(long i=first; i<last; i++)
+    {
+        this->buildPositions[3 * (i - first)] = particles[i].x;
+        this->buildPositions[3 * (i - first) + 1] = particles[i].y;
+        this->buildPositions[3 * (i - first) + 2] = particles[i].z;
+    }
+
+    this->age = 0;
+    this->valid = true;
+}
+
+
+// Largest distance moved by one of the particles [first, last) since the lists were built.
+float InteractionCache::maxDisplacement()
+{
+    float displacement = 0;
+
+    #pragma omp parallel for reduction(max:displacement)
+    for(long i=this->first; i<this->last; i++)
+    {
+        Particle* particle = &this->particleVector[i];
+        float* position = &this->buildPositions[3 * (i - this->first)];
+        float dx = particle->x - position[0], dy = particle->y - position[1], dz = particle->z - position[2];
+
+        displacement = std::max(displacement, std::sqrt(dx*dx + dy*dy + dz*dz));
+    }
+
+    return displacement;
+}
+
+
+// Whether the lists can still be used, given the largest displacement of any particle since they were built.
+// Two particles, or a particle and a center of mass, get at most twice that displacement closer.
+bool InteractionCache::isValid(float displacement)
+{
+    return this->valid && this->age < INTERACTION_LIST_MAX_AGE && 2 * displacement < INTERACTION_LIST_MARGIN;
+}
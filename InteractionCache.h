@@ -0,0 +1,39 @@
+#ifndef NBODY_INTERACTIONCACHE_H
+#define NBODY_INTERACTIONCACHE_H
+
+#include "SerializedCell.h"
+#include <vector>
+
+class SerializedCell;
+
+
+// Interaction lists of this process' particles, kept over several steps.
+//
+// The particles of a leaf form a group, sharing the list of the cells far enough from all of them to be used as clusters
+// and the list of the particles they interact with directly. Particles outside the tree form groups of their own.
+// A cell is far enough from a group when it passes the selected opening criterion for every point of the group's
+// bounding sphere, grown by INTERACTION_LIST_MARGIN. The relative acceleration criterion uses the accelerations of the
+// step the lists were built on. The lists stay valid while no particle moved more than half the margin
+// since they were built, as long as the tree keeps its cells and only its moments are updated.
+class InteractionCache {
+public:
+    Particle* particleVector = nullptr;
+    long first = 0, last = 0;
+    // Group of every particle of [first, last).
+    std::vector<int> groupOf;
+    // Cells and particles of every group's lists, starting at farStart[group] and nearStart[group].
+    std::vector<long> farStart, nearStart;
+    std::vector<int> farCells, nearParticles;
+    // Positions of the particles when the lists were built.
+    std::vector<float> buildPositions;
+    // Steps since the lists were built.
+    int age = 0;
+    bool valid = false;
+
+    void build(SerializedCell&, long, long);
+    float maxDisplacement();
+    bool isValid(float);
+};
+
+
+#endif
@@ -0,0 +1,42 @@
+#include "MemoryTracker.h"
+
+
+std::atomic<long> MemoryTracker::current[MEMORY_CATEGORY_COUNT];
+std::atomic<long> MemoryTracker::peak[MEMORY_CATEGORY_COUNT];
+std::atomic<long> MemoryTracker::currentTotal(0);
+std::atomic<long> MemoryTracker::peakTotal(0);
+
+
+// Raises the peak to the value, unless another thread raised it further already.
+static void raisePeak(std::atomic<long>& peak, long value)
+{
+    long previous = peak.load();
+    while(value > previous && !peak.compare_exchange_weak(previous, value));
+}
+
+
+void MemoryTracker::allocate(MemoryCategory category, long bytes)
+{
+    raisePeak(peak[category], current[category] += bytes);
+    raisePeak(peakTotal, currentTotal += bytes);
+}
+
+
+void MemoryTracker::release(MemoryCategory category, long bytes)
+{
+    current[category] -= bytes;
+    currentTotal -= bytes;
+}
+
+
+const char* MemoryTracker::name(MemoryCategory category)
+{
+    switch(category)
+    {
+        case TREE_NODES: return "tree";
+        case SERIALIZATION_BUFFERS: return "serialization";
+        case COMMUNICATION_BUFFERS: return "communication";
+        case PARTICLES: return "particles";
+        default: return "";
+    }
+}
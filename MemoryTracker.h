@@ -0,0 +1,34 @@
+#ifndef NBODY_MEMORYTRACKER_H
+#define NBODY_MEMORYTRACKER_H
+
+#include <atomic>
+
+
+enum MemoryCategory {
+    // Cell objects built by every process, and the broadcast tree walked by the force pass.
+    TREE_NODES,
+    // Serialized branches and trees.
+    SERIALIZATION_BUFFERS,
+    // Buffers sent and received by MPI.
+    COMMUNICATION_BUFFERS,
+    PARTICLES,
+    MEMORY_CATEGORY_COUNT
+};
+
+
+// Current and peak bytes used by this process, per category.
+// Memory in a node's shared windows is counted once, on the node leader which allocates it.
+class MemoryTracker {
+public:
+    static std::atomic<long> current[MEMORY_CATEGORY_COUNT];
+    static std::atomic<long> peak[MEMORY_CATEGORY_COUNT];
+    static std::atomic<long> currentTotal;
+    static std::atomic<long> peakTotal;
+
+    static void allocate(MemoryCategory, long);
+    static void release(MemoryCategory, long);
+    static const char* name(MemoryCategory);
+};
+
+
+#endif
@@ -0,0 +1,180 @@
+#include "NeighborSearch.h"
+#include <cmath>
+#include <algorithm>
+#include <queue>
+#include <climits>
+
+
+NeighborSearch::NeighborSearch(SerializedCell* tree) : tree(tree), particleCount(LONG_MAX) {};
+
+
+// Squared distance from a point to the bounds of a cell, 0 when the point is inside.
+static float boundsDistance2(float* floats, float x, float y, float z)
+{
+    float dx = std::max(std::max(floats[0] - x, x - floats[1]), 0.0f);
+    float dy = std::max(std::max(floats[2] - y, y - floats[3]), 0.0f);
+    float dz = std::max(std::max(floats[4] - z, z - floats[5]), 0.0f);
+
+    return dx*dx + dy*dy + dz*dz;
+}
+
+
+// Appends the particles within the given radius of the point to neighbors.
+void NeighborSearch::radius(float x, float y, float z, float radius, std::vector<int>& neighbors)
+{
+    float radius2 = radius * radius;
+    long cell = 0;
+
+    while(cell < this->tree->cellCount)
+    {
+        float* cellFloats = &this->tree->serializedCellMatrixFloats[cell * SerializedCell::FLOATS_PER_CELL];
+        int* cellInts = &this->tree->serializedCellMatrixInts[cell * SerializedCell::INTS_PER_CELL];
+
+        if(cellInts[0] == 0 || boundsDistance2(cellFloats, x, y, z) > radius2)
+        {
+            cell = cellInts[2];
+        }
+        else if(this->tree->isLeaf(cell))
+        {
+            for(int j=0; j<cellInts[0]; j++)
+            {
+                int particleIndex = this->tree->serializedParticleIndices[cellInts[1] + j];
+                if(particleIndex >= this->particleCount)
+                {
+                    continue;
+                }
+                Particle* particle = &this->tree->particleVector[particleIndex];
+
+                float dx = particle->x - x, dy = particle->y - y, dz = particle->z - z;
+                if(dx*dx + dy*dy + dz*dz <= radius2)
+                {
+                    neighbors.push_back(particleIndex);
+                }
+            }
+            cell = cellInts[2];
+        }
+        else
+        {
+            cell++;
+        }
+    }
+}
+
+
+// Finds the k particles closest to the point, sorted by distance. Fewer are returned when the tree holds less than k.
+void NeighborSearch::nearest(float x, float y, float z, int k, std::vector<int>& neighbors, std::vector<float>& distances)
+{
+    // The k best candidates so far, with the farthest on top.
+    std::priority_queue<std::pair<float, int>> candidates;
+    long cell = 0;
+
+    while(cell < this->tree->cellCount && k > 0)
+    {
+        float* cellFloats = &this->tree->serializedCellMatrixFloats[cell * SerializedCell::FLOATS_PER_CELL];
+        int* cellInts = &this->tree->serializedCellMatrixInts[cell * SerializedCell::INTS_PER_CELL];
+
+        if(cellInts[0] == 0 || (candidates.size() == k && boundsDistance2(cellFloats, x, y, z) >= candidates.top().first))
+        {
+            cell = cellInts[2];
+        }
+        else if(this->tree->isLeaf(cell))
+        {
+            for(int j=0; j<cellInts[0]; j++)
+            {
+                int particleIndex = this->tree->serializedParticleIndices[cellInts[1] + j];
+                if(particleIndex >= this->particleCount)
+                {
+                    continue;
+                }
+                Particle* particle = &this->tree->particleVector[particleIndex];
+
+                float dx = particle->x - x, dy = particle->y - y, dz = particle->z - z;
+                float d2 = dx*dx + dy*dy + dz*dz;
+
+                if(candidates.size() < k)
+                {
+                    candidates.push(std::make_pair(d2, particleIndex));
+                }
+                else if(d2 < candidates.top().first)
+                {
+                    candidates.pop();
+                    candidates.push(std::make_pair(d2, particleIndex));
+                }
+            }
+            cell = cellInts[2];
+        }
+        else
+        {
+            cell++;
+        }
+    }
+
+    neighbors.resize(candidates.size());
+    distances.resize(candidates.size());
+    for(long i = (long)candidates.size() - 1; i >= 0; i--)
+    {
+        neighbors[i] = candidates.top().second;
+        distances[i] = std::sqrt(candidates.top().first);
+        candidates.pop();
+    }
+}
+
+
+// Distance from every particle of [first, last) to its k-th nearest other particle, or -1 if there are not enough of them.
+void NeighborSearch::nearestDistances(long first, long last, int k, float* distances)
+{
+    #pragma omp parallel
+    {
+        std::vector<int> neighbors;
+        std::vector<float> neighborDistances;
+
+        #pragma omp for schedule(dynamic, 64)
+        for(long i = first; i < last; i++)
+        {
+            Particle* particle = &this->tree->particleVector[i];
+
+            // The particle finds itself, ask for one more.
+            this->nearest(particle->x, particle->y, particle->z, k + 1, neighbors, neighborDistances);
+            distances[i - first] = neighbors.size() > k ? neighborDistances[k] : -1;
+        }
+    }
+}
+
+
+// Lists the pairs (i, j) closer than the given distance, with i in [first, last) and j > i,
+// so that every pair is found exactly once when the particles are split among processes.
+// Returns the number of pairs.
+long NeighborSearch::closePairs(long first, long last, float distance, std::vector<std::pair<int, int>>& pairs)
+{
+    pairs.clear();
+
+    #pragma omp parallel
+    {
+        std::vector<int> neighbors;
+        std::vector<std::pair<int, int>> threadPairs;
+
+        #pragma omp for schedule(dynamic, 64) nowait
+        for(long i = first; i < last; i++)
+        {
+            Particle* particle = &this->tree->particleVector[i];
+
+            neighbors.clear();
+            this->radius(particle->x, particle->y, particle->z, distance, neighbors);
+
+            for(int j=0; j<neighbors.size(); j++)
+            {
+                if(neighbors[j] > i)
+                {
+                    threadPairs.push_back(std::make_pair((int)i, neighbors[j]));
+                }
+            }
+        }
+
+        #pragma omp critical
+        pairs.insert(pairs.end(), threadPairs.begin(), threadPairs.end());
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+
+    return pairs.size();
+}
@@ -0,0 +1,33 @@
+#ifndef NBODY_NEIGHBORSEARCH_H
+#define NBODY_NEIGHBORSEARCH_H
+
+#include "SerializedCell.h"
+#include <vector>
+#include <utility>
+
+class SerializedCell;
+
+
+// Radius and nearest neighbor queries on a serialized tree.
+// Both walk the tree without a stack, skipping the subtrees whose bounds are out of reach,
+// so a query costs about O(log N) instead of a scan of all the particles.
+// Particles are returned as indices in the tree's particle vector.
+class NeighborSearch {
+public:
+    SerializedCell* tree;
+    // Only the particles below this index in the tree's vector are found, which leaves out the pseudo-particles appended
+    // by the distributed trees.
+    long particleCount;
+
+    void radius(float, float, float, float, std::vector<int>&);
+    void nearest(float, float, float, int, std::vector<int>&, std::vector<float>&);
+
+    // Batched queries for the particles [first, last), run in parallel.
+    void nearestDistances(long, long, int, float*);
+    long closePairs(long, long, float, std::vector<std::pair<int, int>>&);
+
+    NeighborSearch(SerializedCell*);
+};
+
+
+#endif
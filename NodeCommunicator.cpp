@@ -0,0 +1,89 @@
+#include "NodeCommunicator.h"
+
+
+NodeCommunicator::NodeCommunicator(MPI_Comm comm, bool shareMemory)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &this->processCount);
+
+    if(shareMemory)
+    {
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &this->node);
+    }
+    else
+    {
+        MPI_Comm_split(comm, rank, 0, &this->node);
+    }
+    MPI_Comm_rank(this->node, &this->nodeRank);
+    MPI_Comm_size(this->node, &this->nodeSize);
+
+    MPI_Comm_split(comm, this->nodeRank == 0 ? 0 : MPI_UNDEFINED, rank, &this->leaders);
+
+    this->nodeOffset = 0;
+    if(this->isLeader())
+    {
+        int leaderRank, leaderCount;
+        MPI_Comm_rank(this->leaders, &leaderRank);
+        MPI_Comm_size(this->leaders, &leaderCount);
+
+        MPI_Exscan(&this->nodeSize, &this->nodeOffset, 1, MPI_INT, MPI_SUM, this->leaders);
+        if(leaderRank == 0)
+        {
+            this->nodeOffset = 0;
+        }
+
+        this->nodeOffsets.resize(leaderCount);
+        this->nodeSizes.resize(leaderCount);
+        MPI_Allgather(&this->nodeOffset, 1, MPI_INT, this->nodeOffsets.data(), 1, MPI_INT, this->leaders);
+        MPI_Allgather(&this->nodeSize, 1, MPI_INT, this->nodeSizes.data(), 1, MPI_INT, this->leaders);
+    }
+
+    MPI_Bcast(&this->nodeOffset, 1, MPI_INT, 0, this->node);
+}
+
+
+NodeCommunicator::~NodeCommunicator()
+{
+    if(this->leaders != MPI_COMM_NULL)
+    {
+        MPI_Comm_free(&this->leaders);
+    }
+    MPI_Comm_free(&this->node);
+}
+
+
+bool NodeCommunicator::isLeader()
+{
+    return this->nodeRank == 0;
+}
+
+
+// Range [first, last) of the n items owned by this process.
+void NodeCommunicator::processRange(long n, long& first, long& last)
+{
+    first = n * (this->nodeOffset + this->nodeRank) / this->processCount;
+    last = n * (this->nodeOffset + this->nodeRank + 1) / this->processCount;
+}
+
+
+// Range [first, last) of the n items owned by the processes of this node.
+void NodeCommunicator::nodeRange(long n, long& first, long& last)
+{
+    first = n * this->nodeOffset / this->processCount;
+    last = n * (this->nodeOffset + this->nodeSize) / this->processCount;
+}
+
+
+// Sizes and offsets of the n items owned by every node, as used by MPI_Allgatherv on the leaders communicator.
+void NodeCommunicator::leaderRanges(long n, std::vector<int>& sizes, std::vector<int>& offsets)
+{
+    sizes.resize(this->nodeOffsets.size());
+    offsets.resize(this->nodeOffsets.size());
+
+    for(int i=0; i<this->nodeOffsets.size(); i++)
+    {
+        offsets[i] = (int)(n * this->nodeOffsets[i] / this->processCount);
+        sizes[i] = (int)(n * (this->nodeOffsets[i] + this->nodeSizes[i]) / this->processCount) - offsets[i];
+    }
+}
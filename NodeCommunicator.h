@@ -0,0 +1,35 @@
+#ifndef NBODY_NODECOMMUNICATOR_H
+#define NBODY_NODECOMMUNICATOR_H
+
+#include <mpi.h>
+#include <vector>
+
+
+// Groups the processes which share the memory of a node.
+// Processes are ordered node by node, so that the processes of a node always own a contiguous range of the particles.
+class NodeCommunicator {
+public:
+    // Processes of this node.
+    MPI_Comm node;
+    // The first process of every node. MPI_COMM_NULL on the other processes.
+    MPI_Comm leaders;
+
+    int nodeRank, nodeSize;
+    int processCount;
+    // Position of this node's first process in the node by node order.
+    int nodeOffset;
+    // Node offsets and sizes of all the nodes. Only set on leaders.
+    std::vector<int> nodeOffsets, nodeSizes;
+
+    bool isLeader();
+    void processRange(long, long&, long&);
+    void nodeRange(long, long&, long&);
+    void leaderRanges(long, std::vector<int>&, std::vector<int>&);
+
+    // Without shared memory, every process forms a node of its own.
+    NodeCommunicator(MPI_Comm, bool = true);
+    ~NodeCommunicator();
+};
+
+
+#endif
@@ -7,7 +7,7 @@
 Particle::Particle() {};
 
 Particle::Particle(float x, float y, float z, float vX, float vY, float vZ, float mass) :
-    x(x), y(y), z(z), vX(vX), vY(vY), vZ(vZ), mass(mass) {};
+    x(x), y(y), z(z), vX(vX), vY(vY), vZ(vZ), mass(mass), acceleration(0), softening(FORCE_SOFTENING) {};
 
 Particle::Particle(const Particle &obj)
 {
@@ -18,6 +18,8 @@ Particle::Particle(const Particle &obj)
     this->vY = obj.vY;
     this->vZ = obj.vZ;
     this->mass = obj.mass;
+    this->acceleration = obj.acceleration;
+    this->softening = obj.softening;
 }
 
 void Particle::setCoordinates(float x, float y, float z)
@@ -37,77 +39,52 @@ void Particle::setMass(float mass)
     this->mass = mass;
 }
 
-// Creates n particles inside the particles vector with a plummer sphere density.
+// Fills the particles [first, last) of the n particles of a plummer sphere density, particles pointing to the first one.
 // a is the softening length.
 // G is the gravitational constant.
-void Particle::plummerSphereDensity(std::vector<Particle>& particles, int n, int a, float G)
+// Every particle draws its random numbers from its own counter range of the seed's stream, so the result only depends
+// on the seed and not on how the particles are split among processes and threads.
+// The coordinates are not scaled, since that needs the bounds of all the particles.
+void Particle::plummerSphereDensity(Particle* particles, int n, int first, int last, int a, float G, unsigned long seed)
 {
-    assert(particles.size() == 0);
-
-    float xMin = 99999, xMax = -999999, yMin = 999999, yMax = -999999, zMin = 999999, zMax = -999999;
-
-    float radius, xx, yy, v, phi, theta, xNew, yNew, zNew, vXNew, vYNew, vZNew, mass;
-    int nGeneratedParticles = 0;
-
-    while(nGeneratedParticles < n)
+    #pragma omp parallel for schedule(static)
+    for(int i=first; i<last; i++)
     {
-        radius = a / std::sqrt((float)pow(randUniform(), -((float)2/3)) - 1);
-        xx = randUniform();
-        yy = (float)(randUniform() * 0.1);
+        // Counters of the random numbers drawn for particle i.
+        unsigned long counter = (unsigned long)i << 20;
 
-        if(yy < pow(xx, 2) * pow((1 - pow(xx, 2)), 3.5))
+        float u = randUniform(seed, counter++);
+        float cbrtU = std::cbrt(u);
+        float radius = a / std::sqrt(1 / (cbrtU * cbrtU) - 1);
+
+        // Rejection sampling of the velocity fraction xx from xx^2 * (1 - xx^2)^3.5.
+        float xx, yy, q;
+        do
         {
-            nGeneratedParticles++;
-            v = xx * sqrt(2*G*n) * pow((pow(radius,2) + pow(a,2)), (-0.25)) / 1000;
-
-            phi = randUniform() * 2 * PI;
-            theta = (float)acos(randUniform()*2 - 1);
-
-            xNew = radius * (float)sin(theta) * (float)cos(phi);
-            yNew = radius * (float)sin(theta) * (float)sin(phi);
-            zNew = radius * (float)cos(theta);
-
-            if(xNew > xMax)
-            {
-                xMax = xNew;
-            }
-            if(xNew < xMin)
-            {
-                xMin = xNew;
-            }
-            if(yNew > yMax)
-            {
-                yMax = yNew;
-            }
-            if(yNew < yMin)
-            {
-                yMin = yNew;
-            }
-            if(zNew > zMax)
-            {
-                zMax = zNew;
-            }
-            if(zNew < zMin)
-            {
-                zMin = zNew;
-            }
-
-            phi = randUniform() * 2 * PI;
-            theta = (float)acos(randUniform()*2 - 1);
-            vXNew = v * (float)sin(theta) * (float)cos(phi);
-            vYNew = v * (float)sin(theta) * (float)sin(phi);
-            vZNew = v * (float)cos(theta);
-
-            mass = MIN_MASS + rand()% (MAX_MASS - MIN_MASS + 1);
-
-            Particle newParticle(xNew, yNew, zNew, vXNew, vYNew, vZNew, mass);
-            particles.push_back(newParticle);
+            xx = randUniform(seed, counter++);
+            yy = (float)(randUniform(seed, counter++) * 0.1);
+            q = 1 - xx * xx;
         }
-    }
+        while(yy >= xx * xx * q * q * q * std::sqrt(q));
 
-    for(int i=0; i<particles.size(); i++)
-    {
-        particles[i].scale(COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, xMin, xMax, yMin, yMax, zMin, zMax);
+        float v = xx * std::sqrt(2*G*n) / std::sqrt(std::sqrt(radius*radius + (float)a*a)) / 1000;
+
+        float phi = randUniform(seed, counter++) * 2 * PI;
+        float theta = (float)acos(randUniform(seed, counter++)*2 - 1);
+
+        float xNew = radius * (float)sin(theta) * (float)cos(phi);
+        float yNew = radius * (float)sin(theta) * (float)sin(phi);
+        float zNew = radius * (float)cos(theta);
+
+        phi = randUniform(seed, counter++) * 2 * PI;
+        theta = (float)acos(randUniform(seed, counter++)*2 - 1);
+        float vXNew = v * (float)sin(theta) * (float)cos(phi);
+        float vYNew = v * (float)sin(theta) * (float)sin(phi);
+        float vZNew = v * (float)cos(theta);
+
+        float mass = MIN_MASS + (int)(randUniform(seed, counter++) * (MAX_MASS - MIN_MASS + 1));
+
+        particles[i - first] = Particle(xNew, yNew, zNew, vXNew, vYNew, vZNew, mass);
     }
 }
 
@@ -126,9 +103,22 @@ void Particle::scale(float scaleMin, float scaleMax, float xMin, float xMax, flo
 // Changes the velocity of the particle after the interaction with the cell.
 void Particle::forcePush(Cell* cell, float timeDelta)
 {
-    float dX = this->x - cell->xCenter;
-    float dY = this->y - cell->yCenter;
-    float dZ = this->z - cell->zCenter;
+    this->forcePush(cell->xCenter, cell->yCenter, cell->zCenter, cell->totalMass, this->softening, timeDelta);
+}
+
+// Changes the velocity of the particle after the direct interaction with another particle.
+// The larger of the two softening lengths is used, so that the pair's forces stay opposite.
+void Particle::forcePush(Particle* particle, float timeDelta)
+{
+    this->forcePush(particle->x, particle->y, particle->z, particle->mass, std::max(this->softening, particle->softening), timeDelta);
+}
+
+// Changes the velocity of the particle after the interaction with a point mass.
+void Particle::forcePush(float x, float y, float z, float mass, float softening, float timeDelta)
+{
+    float dX = this->x - x;
+    float dY = this->y - y;
+    float dZ = this->z - z;
     float d = (float)sqrt(dX * dX + dY * dY + dZ * dZ);
 
     if(d==0)
@@ -137,18 +127,28 @@ void Particle::forcePush(Cell* cell, float timeDelta)
         return;
     }
 
-    // Used to avoid infinite.
-    float softening = 3e4;
-
-    float fX = -(G * this->mass * cell->totalMass)/(d*d + softening*softening) * (dX/d);
-    float fY = -(G * this->mass * cell->totalMass)/(d*d + softening*softening) * (dY/d);
-    float fZ = -(G * this->mass * cell->totalMass)/(d*d + softening*softening) * (dZ/d);
+    float fX = -(G * this->mass * mass)/(d*d + softening*softening) * (dX/d);
+    float fY = -(G * this->mass * mass)/(d*d + softening*softening) * (dY/d);
+    float fZ = -(G * this->mass * mass)/(d*d + softening*softening) * (dZ/d);
 
     this->vX += timeDelta * fX / this->mass;
     this->vY += timeDelta * fY / this->mass;
     this->vZ += timeDelta * fZ / this->mass;
 }
 
+// Potential energy of the particle in the field of a point mass, consistent with the softened force used by forcePush.
+// It is the work of that force from infinity: -G * m * M / softening * (PI / 2 - atan(d / softening)).
+// Computed in double precision, since d can be tiny compared to the softening.
+double Particle::potentialEnergy(float x, float y, float z, float mass, float softening)
+{
+    double dX = this->x - x;
+    double dY = this->y - y;
+    double dZ = this->z - z;
+    double d = sqrt(dX * dX + dY * dY + dZ * dZ);
+
+    return -((double)G * this->mass * mass) / softening * ((double)PI / 2 - atan(d / softening));
+}
+
 // Updates the particle position
 void Particle::updatePosition(float timeDelta)
 {
@@ -18,24 +18,33 @@ private:
         ar & x; ar & y; ar & z;
         ar & vX; ar & vY; ar & vZ;
         ar & mass;
+        ar & acceleration;
+        ar & softening;
     }
 public:
     float x, y, z;
     float vX, vY, vZ;
     float mass;
+    // Magnitude of the acceleration during the previous step, used by the acceleration based opening criteria.
+    float acceleration;
+    // Softening length of the particle's interactions, FORCE_SOFTENING unless it is adapted to the local density.
+    float softening;
 
     void setCoordinates(float, float, float);
     void setMass(float);
     void setSpeed(float, float, float);
     void scale(float, float, float, float, float, float, float, float);
     void forcePush(Cell*, float);
+    void forcePush(Particle*, float);
+    void forcePush(float, float, float, float, float, float);
+    double potentialEnergy(float, float, float, float, float);
     void updatePosition(float);
 
     Particle();
     Particle(float, float, float, float, float, float, float);
     Particle(const Particle &);
 
-    static void plummerSphereDensity(std::vector<Particle>&, int, int, float);
+    static void plummerSphereDensity(Particle*, int, int, int, int, float, unsigned long);
 };
 
 
@@ -0,0 +1,120 @@
+#include "PerformanceCounters.h"
+#include <cstring>
+#include <cstdint>
+#include <omp.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+
+// Opens the counters of every thread of the OpenMP team, and returns whether they are all available.
+bool PerformanceCounters::open()
+{
+    this->close();
+
+#ifdef __linux__
+    static const unsigned long long events[HARDWARE_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    this->descriptors.assign(omp_get_max_threads() * HARDWARE_COUNTER_COUNT, -1);
+    bool failed = false;
+
+    #pragma omp parallel reduction(||:failed)
+    {
+        int thread = omp_get_thread_num();
+
+        for(int i=0; i<HARDWARE_COUNTER_COUNT; i++)
+        {
+            perf_event_attr attributes;
+            std::memset(&attributes, 0, sizeof(attributes));
+            attributes.size = sizeof(attributes);
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.config = events[i];
+            attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // Only the user space part, which doesn't need any privileges.
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+
+            int descriptor = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+            this->descriptors[thread * HARDWARE_COUNTER_COUNT + i] = descriptor;
+            failed = failed || descriptor < 0;
+        }
+    }
+
+    if(failed)
+    {
+        this->close();
+        return false;
+    }
+
+    this->available = true;
+#endif
+
+    return this->available;
+}
+
+
+// Sums the counts of all the threads since the counters were opened.
+void PerformanceCounters::read(double* values)
+{
+    for(int i=0; i<HARDWARE_COUNTER_COUNT; i++)
+    {
+        values[i] = 0;
+    }
+
+#ifdef __linux__
+    if(!this->available)
+    {
+        return;
+    }
+
+    for(size_t j=0; j<this->descriptors.size(); j++)
+    {
+        // Value, time enabled and time running.
+        uint64_t reading[3];
+        if(::read(this->descriptors[j], reading, sizeof(reading)) == sizeof(reading) && reading[2] > 0)
+        {
+            values[j % HARDWARE_COUNTER_COUNT] += (double)reading[0] * reading[1] / reading[2];
+        }
+    }
+#endif
+}
+
+
+void PerformanceCounters::close()
+{
+#ifdef __linux__
+    for(int descriptor : this->descriptors)
+    {
+        if(descriptor >= 0)
+        {
+            ::close(descriptor);
+        }
+    }
+#endif
+    this->descriptors.clear();
+    this->available = false;
+}
+
+
+const char* PerformanceCounters::name(HardwareCounter counter)
+{
+    switch(counter)
+    {
+        case CYCLES: return "cycles";
+        case INSTRUCTIONS: return "instructions";
+        case CACHE_MISSES: return "cache misses";
+        case BRANCH_MISSES: return "branch misses";
+        default: return "";
+    }
+}
+
+
+PerformanceCounters::~PerformanceCounters()
+{
+    this->close();
+}
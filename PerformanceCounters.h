@@ -0,0 +1,39 @@
+#ifndef NBODY_PERFORMANCECOUNTERS_H
+#define NBODY_PERFORMANCECOUNTERS_H
+
+#include <vector>
+
+
+enum HardwareCounter {
+    CYCLES,
+    INSTRUCTIONS,
+    CACHE_MISSES,
+    BRANCH_MISSES,
+    HARDWARE_COUNTER_COUNT
+};
+
+
+// Hardware counters of all the threads of this process, through perf_event_open.
+//
+// A counter only follows the thread which opened it, so every OpenMP thread of the team opens its own, and the readings
+// add them up. They have to be opened from the thread which then runs the parallel regions. Counters multiplexed with
+// others are scaled by the fraction of the time they ran. When any counter can't be opened, for lack of support or of
+// permissions, none is used and the readings stay 0.
+class PerformanceCounters {
+public:
+    // Descriptors of every thread's counters, HARDWARE_COUNTER_COUNT per thread.
+    std::vector<int> descriptors;
+    bool available = false;
+
+    bool open();
+    void read(double*);
+    void close();
+    static const char* name(HardwareCounter);
+
+    PerformanceCounters(){};
+    PerformanceCounters(const PerformanceCounters&) = delete;
+    ~PerformanceCounters();
+};
+
+
+#endif
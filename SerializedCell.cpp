@@ -2,7 +2,8 @@
 #include <stdio.h>
 #include <vector>
 #include <iostream>
-#include <map>
+#include <cmath>
+#include <algorithm>
 #include "Cell.h"
 
 
@@ -10,149 +11,482 @@ SerializedCell::SerializedCell(const SerializedCell &obj)
 {
     this->particleVector = obj.particleVector;
     this->cellCount = obj.cellCount;
+    this->omega = obj.omega;
 
-    this->serializedCellMatrixFloats = new float[this->cellCount*10];
-    for(int i=0; i<this->cellCount*10; i++)
+    this->serializedCellMatrixFloats = new float[this->cellCount*FLOATS_PER_CELL];
+    for(int i=0; i<this->cellCount*FLOATS_PER_CELL; i++)
     {
         this->serializedCellMatrixFloats[i] = obj.serializedCellMatrixFloats[i];
     }
 
-    this->serializedCellMatrixInts = new int[this->cellCount*10];
-    for(int i=0; i<this->cellCount*10; i++)
+    this->serializedCellMatrixInts = new int[this->cellCount*INTS_PER_CELL];
+    for(int i=0; i<this->cellCount*INTS_PER_CELL; i++)
     {
         this->serializedCellMatrixInts[i] = obj.serializedCellMatrixInts[i];
     }
+
+    this->particleIndexCount = obj.particleIndexCount;
+    this->serializedParticleIndices = new int[this->particleIndexCount];
+    for(int i=0; i<this->particleIndexCount; i++)
+    {
+        this->serializedParticleIndices[i] = obj.serializedParticleIndices[i];
+    }
+
+    MemoryTracker::allocate(SERIALIZATION_BUFFERS, this->memoryBytes());
 }
 
 
-void SerializedCell::sdrTraversal(std::vector<Cell *>& cells, Cell *cell)
+// Lists the cells in pre-order, along with the index of the cell following each subtree.
+void SerializedCell::sdrTraversal(std::vector<Cell *>& cells, std::vector<int>& next, Cell *cell)
 {
+    int index = cells.size();
+    cells.push_back(cell);
+    next.push_back(-1);
+
     for(int i=0; i < cell->children.size(); i++)
     {
-        this->sdrTraversal(cells, cell->children[i]);
+        this->sdrTraversal(cells, next, cell->children[i]);
     }
 
-    cells.push_back(cell);
+    next[index] = cells.size();
 }
 
 
-void SerializedCell::serializeTree(Cell* cell)
+void SerializedCell::allocate(long cellCount, long particleIndexCount)
 {
-    if(this->serializedCellMatrixFloats != nullptr)
+    if(this->ownsArrays)
     {
+        MemoryTracker::release(SERIALIZATION_BUFFERS, this->memoryBytes());
         delete[] this->serializedCellMatrixFloats;
-    }
-    if(this->serializedCellMatrixInts != nullptr)
-    {
         delete[] this->serializedCellMatrixInts;
+        delete[] this->serializedParticleIndices;
     }
 
-    std::vector<Cell*> cells;
-    sdrTraversal(cells, cell);
+    this->ownsArrays = true;
+    this->cellCount = cellCount;
+    this->particleIndexCount = particleIndexCount;
+    this->serializedCellMatrixFloats = new float[cellCount * FLOATS_PER_CELL];
+    this->serializedCellMatrixInts = new int[cellCount * INTS_PER_CELL];
+    this->serializedParticleIndices = new int[particleIndexCount];
+    MemoryTracker::allocate(SERIALIZATION_BUFFERS, this->memoryBytes());
+}
+
+
+// Writes the cell's bounds, center of gravity and counts. The particle indices are written by the caller.
+static void writeCell(SerializedCell& tree, long index, Cell* cell, int particleOffset, int next)
+{
+    float* floats = &tree.serializedCellMatrixFloats[index * SerializedCell::FLOATS_PER_CELL];
+    int* ints = &tree.serializedCellMatrixInts[index * SerializedCell::INTS_PER_CELL];
 
-    std::map<Cell*, int> cellAddressToSerializedIndex;
+    floats[0] = cell->xMin;
+    floats[1] = cell->xMax;
+    floats[2] = cell->yMin;
+    floats[3] = cell->yMax;
+    floats[4] = cell->zMin;
+    floats[5] = cell->zMax;
+    floats[6] = cell->xCenter;
+    floats[7] = cell->yCenter;
+    floats[8] = cell->zCenter;
+    floats[9] = cell->totalMass;
 
+    ints[0] = cell->particleCount;
+    ints[1] = cell->particles.size() > 0 ? particleOffset : -1;
+    ints[2] = next;
+}
+
+
+void SerializedCell::serializeTree(Cell* cell)
+{
+    std::vector<Cell*> cells;
+    std::vector<int> next;
+    sdrTraversal(cells, next, cell);
+
+    long particleIndexCount = 0;
     for(int i=0; i<cells.size(); i++)
     {
-        cellAddressToSerializedIndex[cells[i]] = i;
+        particleIndexCount += cells[i]->particles.size();
     }
 
-    this->cellCount = cells.size();
-    this->serializedCellMatrixFloats = new float[this->cellCount * 10];
-    this->serializedCellMatrixInts = new int[this->cellCount * 10];
+    this->allocate(cells.size(), particleIndexCount);
 
-    for(int i=0; i<cells.size(); i++)
+    for(int i=0, k=0; i<cells.size(); i++)
     {
-        this->serializedCellMatrixFloats[i * 10 + 0] = cells[i]->xMin;
-        this->serializedCellMatrixFloats[i * 10 + 1] = cells[i]->xMax;
-        this->serializedCellMatrixFloats[i * 10 + 2] = cells[i]->yMin;
-        this->serializedCellMatrixFloats[i * 10 + 3] = cells[i]->yMax;
-        this->serializedCellMatrixFloats[i * 10 + 4] = cells[i]->zMin;
-        this->serializedCellMatrixFloats[i * 10 + 5] = cells[i]->zMax;
-        this->serializedCellMatrixFloats[i * 10 + 6] = cells[i]->xCenter;
-        this->serializedCellMatrixFloats[i * 10 + 7] = cells[i]->yCenter;
-        this->serializedCellMatrixFloats[i * 10 + 8] = cells[i]->zCenter;
-        this->serializedCellMatrixFloats[i * 10 + 9] = cells[i]->totalMass;
+        writeCell(*this, i, cells[i], k, next[i]);
+
+        for(int j=0; j<cells[i]->particles.size(); j++, k++)
+        {
+            // Index of the particle in the particle vector.
+            this->serializedParticleIndices[k] = (int)(cells[i]->particles[j] - this->particleVector);
+        }
     }
+}
 
-    for(int i=0; i<cells.size(); i++)
+
+// Assembles the whole tree from the root, its 8 children and the 64 serialized branches below them.
+// The root only provides the geometry of the first two levels. branches[i * 8 + j] is the branch of root->children[i]->children[j].
+void SerializedCell::assembleTree(Cell* root, std::vector<SerializedCell*>& branches)
+{
+    long cellCount = 1 + root->children.size(), particleIndexCount = 0;
+    for(int i=0; i<branches.size(); i++)
     {
-        this->serializedCellMatrixInts[i*10 + 0] = cells[i]->particleCount;
+        cellCount += branches[i]->cellCount;
+        particleIndexCount += branches[i]->particleIndexCount;
+    }
+
+    this->allocate(cellCount, particleIndexCount);
+
+    long cell = 1, particleOffset = 0;
+
+    for(int i=0; i<root->children.size(); i++)
+    {
+        Cell* levelOneCell = root->children[i];
+        long levelOneIndex = cell++;
 
-        if(cells[i]->particle)
+        for(int j=0; j<levelOneCell->children.size(); j++)
         {
-            for(int j=0; j<this->particleVector->size(); j++)
+            SerializedCell* branch = branches[i * levelOneCell->children.size() + j];
+
+            // Copy the branch, moving its links past the cells and the particle indices already written.
+            std::copy(branch->serializedCellMatrixFloats, branch->serializedCellMatrixFloats + branch->cellCount * FLOATS_PER_CELL, &this->serializedCellMatrixFloats[cell * FLOATS_PER_CELL]);
+            std::copy(branch->serializedParticleIndices, branch->serializedParticleIndices + branch->particleIndexCount, &this->serializedParticleIndices[particleOffset]);
+
+            for(long k=0; k<branch->cellCount; k++)
             {
-                if(&(*this->particleVector)[j] == cells[i]->particle)
-                {
-                    // Index of the particle in the particle vector.
-                    this->serializedCellMatrixInts[i*10 + 1] = j;
-                }
+                int* from = &branch->serializedCellMatrixInts[k * INTS_PER_CELL];
+                int* to = &this->serializedCellMatrixInts[(cell + k) * INTS_PER_CELL];
+
+                to[0] = from[0];
+                to[1] = from[1] == -1 ? -1 : (int)(from[1] + particleOffset);
+                to[2] = (int)(from[2] + cell);
             }
+
+            // Add the branch to the center of gravity, the total mass and the particle count of the first level cell.
+            float branchMass = branch->serializedCellMatrixFloats[9];
+            if(branchMass > 0)
+            {
+                levelOneCell->xCenter = (levelOneCell->totalMass * levelOneCell->xCenter + branchMass * branch->serializedCellMatrixFloats[6]) / (levelOneCell->totalMass + branchMass);
+                levelOneCell->yCenter = (levelOneCell->totalMass * levelOneCell->yCenter + branchMass * branch->serializedCellMatrixFloats[7]) / (levelOneCell->totalMass + branchMass);
+                levelOneCell->zCenter = (levelOneCell->totalMass * levelOneCell->zCenter + branchMass * branch->serializedCellMatrixFloats[8]) / (levelOneCell->totalMass + branchMass);
+                levelOneCell->totalMass += branchMass;
+            }
+            levelOneCell->particleCount += branch->serializedCellMatrixInts[0];
+
+            cell += branch->cellCount;
+            particleOffset += branch->particleIndexCount;
         }
-        else
+
+        writeCell(*this, levelOneIndex, levelOneCell, -1, (int)cell);
+
+        if(levelOneCell->totalMass > 0)
         {
-            this->serializedCellMatrixInts[i*10 + 1] = -1;
+            root->xCenter = (root->totalMass * root->xCenter + levelOneCell->totalMass * levelOneCell->xCenter) / (root->totalMass + levelOneCell->totalMass);
+            root->yCenter = (root->totalMass * root->yCenter + levelOneCell->totalMass * levelOneCell->yCenter) / (root->totalMass + levelOneCell->totalMass);
+            root->zCenter = (root->totalMass * root->zCenter + levelOneCell->totalMass * levelOneCell->zCenter) / (root->totalMass + levelOneCell->totalMass);
+            root->totalMass += levelOneCell->totalMass;
         }
+        root->particleCount += levelOneCell->particleCount;
+    }
+
+    writeCell(*this, 0, root, -1, (int)cell);
+}
+
+
+// Updates the centers of mass to the current positions of the particles, keeping the cells.
+// Bounds are grown to still hold the particles which moved out of their cell, so that searches don't miss them.
+// Children follow their parent in pre-order, so going backwards visits every child before its parent.
+void SerializedCell::refit()
+{
+    for(long cell = this->cellCount - 1; cell >= 0; cell--)
+    {
+        float* floats = &this->serializedCellMatrixFloats[cell * FLOATS_PER_CELL];
+        int* ints = &this->serializedCellMatrixInts[cell * INTS_PER_CELL];
+
+        if(ints[0] == 0)
+        {
+            continue;
+        }
+
+        double mass = 0, x = 0, y = 0, z = 0;
 
-        for(int j=0; j<8; j++)
+        if(this->isLeaf(cell))
         {
-            if(j < cells[i]->children.size())
+            for(int j=0; j<ints[0]; j++)
             {
-                this->serializedCellMatrixInts[i*10 + 2 + j] = cellAddressToSerializedIndex[cells[i]->children[j]];
+                Particle* particle = &this->particleVector[this->serializedParticleIndices[ints[1] + j]];
+
+                mass += particle->mass;
+                x += (double)particle->mass * particle->x;
+                y += (double)particle->mass * particle->y;
+                z += (double)particle->mass * particle->z;
+
+                floats[0] = std::min(floats[0], particle->x); floats[1] = std::max(floats[1], particle->x);
+                floats[2] = std::min(floats[2], particle->y); floats[3] = std::max(floats[3], particle->y);
+                floats[4] = std::min(floats[4], particle->z); floats[5] = std::max(floats[5], particle->z);
             }
-            else
+        }
+        else
+        {
+            for(long child = cell + 1; child < ints[2]; child = this->serializedCellMatrixInts[child * INTS_PER_CELL + 2])
             {
-                this->serializedCellMatrixInts[i*10 + 2 + j] = -1;
+                float* childFloats = &this->serializedCellMatrixFloats[child * FLOATS_PER_CELL];
+
+                mass += childFloats[9];
+                x += (double)childFloats[9] * childFloats[6];
+                y += (double)childFloats[9] * childFloats[7];
+                z += (double)childFloats[9] * childFloats[8];
+
+                for(int axis=0; axis<3; axis++)
+                {
+                    floats[axis*2] = std::min(floats[axis*2], childFloats[axis*2]);
+                    floats[axis*2 + 1] = std::max(floats[axis*2 + 1], childFloats[axis*2 + 1]);
+                }
             }
         }
+
+        floats[6] = (float)(x / mass);
+        floats[7] = (float)(y / mass);
+        floats[8] = (float)(z / mass);
+        floats[9] = (float)mass;
     }
 }
 
 
-Cell* SerializedCell::deserializeTree()
+// Computes the offsets of the centers of mass from the cell centers. Only needed with the CENTER_OFFSET criterion.
+void SerializedCell::computeCenterOffsets()
 {
-    std::vector<Cell*> deserializedCells;
+    if(OPENING_CRITERION != CENTER_OFFSET)
+    {
+        return;
+    }
+
+    this->centerOffsets.resize(this->cellCount);
 
-    for(int i=0; i<this->cellCount; i++)
+    #pragma omp parallel for
+    for(long cell = 0; cell < this->cellCount; cell++)
     {
-        Cell* newCell = new Cell();
-        deserializedCells.push_back(newCell);
+        float* floats = &this->serializedCellMatrixFloats[cell * FLOATS_PER_CELL];
+        float ox = floats[6] - (floats[0] + floats[1]) / 2;
+        float oy = floats[7] - (floats[2] + floats[3]) / 2;
+        float oz = floats[8] - (floats[4] + floats[5]) / 2;
+
+        this->centerOffsets[cell] = std::sqrt(ox*ox + oy*oy + oz*oz);
+    }
+}
+
+
+// Size of the cell and particle index arrays.
+long SerializedCell::memoryBytes()
+{
+    return this->cellCount * (FLOATS_PER_CELL * sizeof(float) + INTS_PER_CELL * sizeof(int)) + this->particleIndexCount * sizeof(int);
+}
+
+
+bool SerializedCell::isLeaf(long index)
+{
+    return this->serializedCellMatrixInts[index * INTS_PER_CELL + 2] == index + 1;
+}
 
-        newCell->xMin = serializedCellMatrixFloats[i*10 + 0];
-        newCell->xMax = serializedCellMatrixFloats[i*10 + 1];
-        newCell->yMin = serializedCellMatrixFloats[i*10 + 2];
-        newCell->yMax = serializedCellMatrixFloats[i*10 + 3];
-        newCell->zMin = serializedCellMatrixFloats[i*10 + 4];
-        newCell->zMax = serializedCellMatrixFloats[i*10 + 5];
-        newCell->xCenter = serializedCellMatrixFloats[i*10 + 6];
-        newCell->yCenter = serializedCellMatrixFloats[i*10 + 7];
-        newCell->zCenter = serializedCellMatrixFloats[i*10 + 8];
-        newCell->totalMass = serializedCellMatrixFloats[i*10 + 9];
 
-        newCell->particleCount = serializedCellMatrixInts[i*10 + 0];
+static bool isInsideBounds(float* floats, Particle* particle)
+{
+    return floats[0] <= particle->x && particle->x <= floats[1]
+           && floats[2] <= particle->y && particle->y <= floats[3]
+           && floats[4] <= particle->z && particle->z <= floats[5];
+}
+
+
+// A leaf which holds the particle itself is never used as a cluster, its particles are interacted with directly.
+// All the criteria compare squared distances, so that the walk doesn't need a square root per cell.
+bool SerializedCell::isFarEnoughFromParticleToUseAsCluster(long index, Particle* particle)
+{
+    float* floats = &this->serializedCellMatrixFloats[index * FLOATS_PER_CELL];
+    int* ints = &this->serializedCellMatrixInts[index * INTS_PER_CELL];
 
-        if(serializedCellMatrixInts[i*10 + 1] == -1)
+    if(this->isLeaf(index))
+    {
+        for(int i=0; i<ints[0]; i++)
         {
-            newCell->particle = nullptr;
+            if(&this->particleVector[this->serializedParticleIndices[ints[1] + i]] == particle)
+            {
+                return false;
+            }
         }
-        else
+    }
+
+    float s = floats[1] - floats[0];
+
+    float dx = particle->x - floats[6];
+    float dy = particle->y - floats[7];
+    float dz = particle->z - floats[8];
+
+    // With periodic boundaries the distance is to the nearest image of the center of mass. Cells reaching half the box
+    // away from the particle hold particles nearer through other images, and are always opened.
+    if(PERIODIC_BOUNDARIES)
+    {
+        if(crossesHalfBox(particle->x - (floats[0] + floats[1]) / 2, s) || crossesHalfBox(particle->y - (floats[2] + floats[3]) / 2, s)
+           || crossesHalfBox(particle->z - (floats[4] + floats[5]) / 2, s))
         {
-            newCell->particle = &(*this->particleVector)[serializedCellMatrixInts[i*10 + 1]];
+            return false;
         }
+
+        dx = nearestImage(dx);
+        dy = nearestImage(dy);
+        dz = nearestImage(dz);
     }
 
-    for(int i=0; i<deserializedCells.size(); i++)
+    float d2 = dx*dx + dy*dy + dz*dz;
+
+    // The acceleration criteria bound the estimated error of the cluster's acceleration, G * M * s^2 / d^2 / (d^2 + softening^2),
+    // and only apply to cells which don't hold the particle.
+    switch(OPENING_CRITERION)
     {
-        for(int j=0; j<8; j++)
+        case CENTER_OFFSET:
         {
-            // Assumption: the cell either has the maximum children count or none.
-            if(serializedCellMatrixInts[i*10 + 2 + j] != -1)
+            float minimumDistance = s / this->omega + this->centerOffsets[index];
+
+            return d2 > minimumDistance * minimumDistance;
+        }
+
+        case RELATIVE_ACCELERATION:
+            // There's no previous acceleration on the first step, fall back to the geometric test.
+            if(particle->acceleration > 0)
             {
-                deserializedCells[i]->children.push_back(deserializedCells[serializedCellMatrixInts[i*10 + 2 + j]]);
+                return !isInsideBounds(floats, particle)
+                       && G * floats[9] * s * s < ACCELERATION_TOLERANCE * particle->acceleration * d2 * (d2 + FORCE_SOFTENING * FORCE_SOFTENING);
             }
+            break;
+
+        case ABSOLUTE_ACCELERATION:
+            return !isInsideBounds(floats, particle)
+                   && G * floats[9] * s * s < ACCELERATION_TOLERANCE * d2 * (d2 + FORCE_SOFTENING * FORCE_SOFTENING);
+
+        case GEOMETRIC:
+            break;
+    }
+
+    return s * s < this->omega * this->omega * d2;
+}
+
+
+// Distance of the coordinate to the interval, through the nearest image with periodic boundaries.
+static float intervalDistance(float coordinate, float lower, float upper)
+{
+    float distance = std::max(std::max(lower - coordinate, coordinate - upper), 0.0f);
+
+    if(PERIODIC_BOUNDARIES)
+    {
+        float size = COORDINATE_MAX_VALUE - COORDINATE_MIN_VALUE;
+        distance = std::min(distance, std::max(std::max(lower - coordinate - size, coordinate - size - upper), 0.0f));
+        distance = std::min(distance, std::max(std::max(lower - coordinate + size, coordinate + size - upper), 0.0f));
+    }
+
+    return distance;
+}
+
+
+// Whether every particle inside the bounds would use the cell as a cluster, for the parts of the tree sent to other
+// processes. The distance of a particle to the center of mass is at least the distance of the bounds to it, and cells
+// overlapping the bounds are always opened, as are the cells which the periodic test would open for some particle.
+// The relative acceleration criterion needs the accelerations of the particles, so it falls back to the geometric
+// test, as on the first step.
+bool SerializedCell::isFarEnoughFromBoundsToUseAsCluster(long index, float* bounds)
+{
+    float* floats = &this->serializedCellMatrixFloats[index * FLOATS_PER_CELL];
+
+    if(floats[0] <= bounds[1] && bounds[0] <= floats[1] && floats[2] <= bounds[3] && bounds[2] <= floats[3]
+       && floats[4] <= bounds[5] && bounds[4] <= floats[5])
+    {
+        return false;
+    }
+
+    float s = floats[1] - floats[0];
+
+    float dx = intervalDistance(floats[6], bounds[0], bounds[1]);
+    float dy = intervalDistance(floats[7], bounds[2], bounds[3]);
+    float dz = intervalDistance(floats[8], bounds[4], bounds[5]);
+    float d2 = dx*dx + dy*dy + dz*dz;
+
+    if(PERIODIC_BOUNDARIES && (crossesHalfBox((bounds[0] + bounds[1] - floats[0] - floats[1]) / 2, bounds[1] - bounds[0] + s)
+                               || crossesHalfBox((bounds[2] + bounds[3] - floats[2] - floats[3]) / 2, bounds[3] - bounds[2] + s)
+                               || crossesHalfBox((bounds[4] + bounds[5] - floats[4] - floats[5]) / 2, bounds[5] - bounds[4] + s)))
+    {
+        return false;
+    }
+
+    switch(OPENING_CRITERION)
+    {
+        case CENTER_OFFSET:
+        {
+            float minimumDistance = s / this->omega + this->centerOffsets[index];
+
+            return d2 > minimumDistance * minimumDistance;
+        }
+
+        case ABSOLUTE_ACCELERATION:
+            return G * floats[9] * s * s < ACCELERATION_TOLERANCE * d2 * (d2 + FORCE_SOFTENING * FORCE_SOFTENING);
+
+        case RELATIVE_ACCELERATION:
+        case GEOMETRIC:
+            break;
+    }
+
+    return s * s < this->omega * this->omega * d2;
+}
+
+
+// Whether every particle within the radius of the center would use the cell as a cluster, for the interaction lists
+// kept over several steps. The distance of such a particle to the center of mass is at least the distance of the center
+// to it less the radius, and the acceleration criteria also open the cells the sphere reaches into. The relative
+// acceleration criterion takes the smallest acceleration of the particles, and falls back to the geometric test when
+// one of them has none yet, as on the first step. Without periodic images, which the lists don't support.
+bool SerializedCell::isFarEnoughFromSphereToUseAsCluster(long index, float* center, float radius, float acceleration)
+{
+    float* floats = &this->serializedCellMatrixFloats[index * FLOATS_PER_CELL];
+
+    float s = floats[1] - floats[0];
+
+    float dx = center[0] - floats[6];
+    float dy = center[1] - floats[7];
+    float dz = center[2] - floats[8];
+    float d2 = dx*dx + dy*dy + dz*dz;
+
+    if(d2 <= radius * radius)
+    {
+        return false;
+    }
+
+    // Only done when the lists are built, so the square root doesn't weigh on the walk.
+    float d = std::sqrt(d2) - radius;
+    d2 = d * d;
+
+    float bx = std::max(std::max(floats[0] - center[0], center[0] - floats[1]), 0.0f);
+    float by = std::max(std::max(floats[2] - center[1], center[1] - floats[3]), 0.0f);
+    float bz = std::max(std::max(floats[4] - center[2], center[2] - floats[5]), 0.0f);
+    bool reachesBounds = bx*bx + by*by + bz*bz <= radius * radius;
+
+    switch(OPENING_CRITERION)
+    {
+        case CENTER_OFFSET:
+        {
+            float minimumDistance = s / this->omega + this->centerOffsets[index];
+
+            return d2 > minimumDistance * minimumDistance;
         }
+
+        case RELATIVE_ACCELERATION:
+            if(acceleration > 0)
+            {
+                return !reachesBounds
+                       && G * floats[9] * s * s < ACCELERATION_TOLERANCE * acceleration * d2 * (d2 + FORCE_SOFTENING * FORCE_SOFTENING);
+            }
+            break;
+
+        case ABSOLUTE_ACCELERATION:
+            return !reachesBounds && G * floats[9] * s * s < ACCELERATION_TOLERANCE * d2 * (d2 + FORCE_SOFTENING * FORCE_SOFTENING);
+
+        case GEOMETRIC:
+            break;
     }
 
-    return deserializedCells[deserializedCells.size()-1];
+    return s * s < this->omega * this->omega * d2;
 }
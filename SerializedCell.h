@@ -3,6 +3,7 @@
 #include "common.h"
 #include "Cell.h"
 #include "Particle.h"
+#include "MemoryTracker.h"
 #include <vector>
 #include <boost/serialization/list.hpp>
 #include <boost/serialization/string.hpp>
@@ -15,39 +16,61 @@
 class Particle;
 class Cell;
 
+// A tree flattened into arrays, with the cells in pre-order: every cell is followed by its subtree.
+// Each cell holds FLOATS_PER_CELL floats:
+//     xMin, xMax, yMin, yMax, zMin, zMax, xCenter, yCenter, zCenter, totalMass
+// and INTS_PER_CELL ints:
+//     particleCount, start of the leaf's particle indices (or -1), index of the cell following the subtree.
+// The children of a cell start right after it, and each one is followed by the next one's skip link,
+// so the tree can be walked without a stack.
 class SerializedCell {
 public:
     friend class boost::serialization::access;
 
+    static const int FLOATS_PER_CELL = 10;
+    static const int INTS_PER_CELL = 3;
+
     template<class Archive>
     void save(Archive & ar, const unsigned int version) const
     {
         ar << this->cellCount;
-        for(int i=0; i<this->cellCount*10; i++)
+        for(int i=0; i<this->cellCount*FLOATS_PER_CELL; i++)
         {
             ar << this->serializedCellMatrixFloats[i];
         }
-        for(int i=0; i<this->cellCount*10; i++)
+        for(int i=0; i<this->cellCount*INTS_PER_CELL; i++)
         {
             ar << this->serializedCellMatrixInts[i];
         }
+        ar << this->particleIndexCount;
+        for(int i=0; i<this->particleIndexCount; i++)
+        {
+            ar << this->serializedParticleIndices[i];
+        }
     }
 
     template<class Archive>
     void load(Archive & ar, const unsigned int version)
     {
         ar >> this->cellCount;
-        this->serializedCellMatrixFloats = new float[this->cellCount*10];
-        this->serializedCellMatrixInts = new int[this->cellCount*10];
+        this->serializedCellMatrixFloats = new float[this->cellCount*FLOATS_PER_CELL];
+        this->serializedCellMatrixInts = new int[this->cellCount*INTS_PER_CELL];
 
-        for(int i=0; i<this->cellCount*10; i++)
+        for(int i=0; i<this->cellCount*FLOATS_PER_CELL; i++)
         {
             ar>>this->serializedCellMatrixFloats[i];
         }
-        for(int i=0; i<this->cellCount*10; i++)
+        for(int i=0; i<this->cellCount*INTS_PER_CELL; i++)
         {
             ar>>this->serializedCellMatrixInts[i];
         }
+        ar >> this->particleIndexCount;
+        this->serializedParticleIndices = new int[this->particleIndexCount];
+        for(int i=0; i<this->particleIndexCount; i++)
+        {
+            ar>>this->serializedParticleIndices[i];
+        }
+        MemoryTracker::allocate(SERIALIZATION_BUFFERS, this->memoryBytes());
     }
 
     template<class Archive>
@@ -56,22 +79,45 @@ public:
         boost::serialization::split_member(ar, *this, version);
     }
 
-    std::vector<Particle> *particleVector;
+    Particle* particleVector;
     float* serializedCellMatrixFloats = nullptr;
     int* serializedCellMatrixInts = nullptr;
     long cellCount = 0;
+    // Indices of the particles held by the leaves. Each leaf points to the start of its own run.
+    int* serializedParticleIndices = nullptr;
+    long particleIndexCount = 0;
+    // Set to false when the arrays are only a view on memory owned by someone else.
+    bool ownsArrays = true;
+    // Opening angle used by the criteria, so that simulations with different ones can run side by side.
+    float omega = OMEGA;
+    // Distance of every cell's center of mass from its center, for the CENTER_OFFSET criterion. Filled by
+    // computeCenterOffsets whenever the cells change, so that the walk doesn't take a square root per cell.
+    std::vector<float> centerOffsets;
 
-    void sdrTraversal(std::vector<Cell*>&, Cell*);
+    void sdrTraversal(std::vector<Cell*>&, std::vector<int>&, Cell*);
     void serializeTree(Cell*);
-    Cell* deserializeTree();
+    void assembleTree(Cell*, std::vector<SerializedCell*>&);
+    void allocate(long, long);
+    bool isLeaf(long);
+    long memoryBytes();
+    void refit();
+    void computeCenterOffsets();
+    bool isFarEnoughFromParticleToUseAsCluster(long, Particle*);
+    bool isFarEnoughFromBoundsToUseAsCluster(long, float*);
+    bool isFarEnoughFromSphereToUseAsCluster(long, float*, float, float);
 
     SerializedCell(){};
     SerializedCell(const SerializedCell &);
 
     ~SerializedCell()
     {
-        delete[] serializedCellMatrixFloats;
-        delete[] serializedCellMatrixInts;
+        if(ownsArrays)
+        {
+            MemoryTracker::release(SERIALIZATION_BUFFERS, this->memoryBytes());
+            delete[] serializedCellMatrixFloats;
+            delete[] serializedCellMatrixInts;
+            delete[] serializedParticleIndices;
+        }
     };
 };
 
@@ -0,0 +1,82 @@
+#ifndef NBODY_SHAREDARRAY_H
+#define NBODY_SHAREDARRAY_H
+
+#include "NodeCommunicator.h"
+#include "MemoryTracker.h"
+#include <mpi.h>
+#include <algorithm>
+
+
+// Array kept in an MPI shared memory window, so that all the processes of a node access the same copy.
+// The memory is allocated by the node leader. Resizing is collective over the node.
+template<class T>
+class SharedArray {
+public:
+    MPI_Win window = MPI_WIN_NULL;
+    MPI_Comm node = MPI_COMM_NULL;
+    T* base = nullptr;
+    long count = 0;
+    long capacity = 0;
+    // Category the leader's allocation is reported under.
+    MemoryCategory category = PARTICLES;
+    long allocatedBytes = 0;
+
+    // Makes room for n items, dropping the current content if the window has to grow.
+    // Has to be called with the same n by all the processes of the node.
+    void resize(NodeCommunicator& nodeCommunicator, long n)
+    {
+        if(n > this->capacity)
+        {
+            // Grow geometrically, since trees change size every step.
+            long capacity = std::max(n, this->capacity * 3 / 2);
+
+            this->free();
+            this->capacity = capacity;
+            this->node = nodeCommunicator.node;
+
+            MPI_Aint bytes = nodeCommunicator.isLeader() ? this->capacity * sizeof(T) : 0;
+            MPI_Win_allocate_shared(bytes, sizeof(T), MPI_INFO_NULL, this->node, &this->base, &this->window);
+            this->allocatedBytes = bytes;
+            MemoryTracker::allocate(this->category, this->allocatedBytes);
+
+            MPI_Aint leaderBytes;
+            int displacementUnit;
+            MPI_Win_shared_query(this->window, 0, &leaderBytes, &displacementUnit, &this->base);
+            MPI_Win_lock_all(MPI_MODE_NOCHECK, this->window);
+        }
+
+        this->count = n;
+    }
+
+    // Makes the writes of every process of the node visible to the others.
+    void synchronize()
+    {
+        MPI_Win_sync(this->window);
+        MPI_Barrier(this->node);
+        MPI_Win_sync(this->window);
+    }
+
+    void free()
+    {
+        if(this->window != MPI_WIN_NULL)
+        {
+            MPI_Win_unlock_all(this->window);
+            MPI_Win_free(&this->window);
+            MemoryTracker::release(this->category, this->allocatedBytes);
+            this->allocatedBytes = 0;
+        }
+        this->base = nullptr;
+        this->count = 0;
+        this->capacity = 0;
+    }
+
+    T* data() { return this->base; }
+    long size() { return this->count; }
+    T& operator[](long i) { return this->base[i]; }
+
+    SharedArray(){};
+    SharedArray(const SharedArray&) = delete;
+};
+
+
+#endif
@@ -0,0 +1,1132 @@
+#include "Simulation.h"
+#include "Cell.h"
+#include "SerializedCell.h"
+#include "CompactTree.h"
+#include "NeighborSearch.h"
+#include "ConcurrentTree.h"
+#include "InteractionCache.h"
+#include <boost/serialization/vector.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <omp.h>
+
+namespace mpi = boost::mpi;
+
+
+// Creates the node communicator and the shared particle vector, holding all the particles or this process' slice of them.
+void Simulation::initialize(long particleCount)
+{
+    this->nodeCommunicator = new NodeCommunicator(this->world, !DISTRIBUTED_OWNERSHIP);
+
+    MPI_Type_contiguous(sizeof(Particle), MPI_BYTE, &this->particleType);
+    MPI_Type_commit(&this->particleType);
+
+    this->sharedCellFloats.category = TREE_NODES;
+    this->sharedCellInts.category = TREE_NODES;
+    this->sharedParticleIndices.category = TREE_NODES;
+    this->tree.ownsArrays = false;
+
+    if(PERIODIC_BOUNDARIES)
+    {
+        this->ewald.compute(EWALD_TABLE_SIZE, COORDINATE_MAX_VALUE - COORDINATE_MIN_VALUE);
+
+        double tableError = this->ewald.check(EWALD_CHECK_SAMPLES);
+        if(tableError > EWALD_TABLE_TOLERANCE && this->world.rank() == 0)
+        {
+            fprintf(stderr, "The Ewald table is off by %g of the correction, increase EWALD_TABLE_SIZE\n", tableError);
+        }
+
+        // The correction is for unsoftened forces, which the softened ones only follow well below the box size.
+        if(FORCE_SOFTENING * 10 > COORDINATE_MAX_VALUE - COORDINATE_MIN_VALUE && this->world.rank() == 0)
+        {
+            fprintf(stderr, "The softening length isn't small compared to the periodic box, the Ewald correction won't match the forces\n");
+        }
+    }
+
+    if(DISTRIBUTED_OWNERSHIP)
+    {
+        long first, last;
+        this->nodeCommunicator->processRange(particleCount, first, last);
+        this->ownedCount = last - first;
+        this->particles.resize(*this->nodeCommunicator, this->ownedCount);
+    }
+    else
+    {
+        this->particles.resize(*this->nodeCommunicator, particleCount);
+    }
+}
+
+
+// Exchange the particles owned by every node, so that each node has all of them.
+void Simulation::allGatherParticles()
+{
+    this->particles.synchronize();
+
+    if(this->nodeCommunicator->isLeader())
+    {
+        std::vector<int> sizes, offsets;
+        this->nodeCommunicator->leaderRanges(this->particles.size(), sizes, offsets);
+        MPI_Allgatherv(MPI_IN_PLACE, 0, this->particleType, this->particles.data(), sizes.data(), offsets.data(), this->particleType, this->nodeCommunicator->leaders);
+    }
+
+    this->particles.synchronize();
+}
+
+
+Simulation::Simulation(MPI_Comm comm, long particleCount, unsigned long seed, float omega, int softeningLength) : world(comm, mpi::comm_duplicate)
+{
+    this->initialize(particleCount);
+    this->tree.omega = omega;
+
+    // Every process generates its own slice of the particle vector with a plummer sphere density.
+    long first, last;
+    this->nodeCommunicator->processRange(particleCount, first, last);
+    Particle* slice = &this->particles[DISTRIBUTED_OWNERSHIP ? 0 : first];
+
+    Particle::plummerSphereDensity(slice, particleCount, first, last, softeningLength, G, seed);
+
+    // Reduce the bounds of all the particles.
+    float xMin = FLT_MAX, xMax = -FLT_MAX, yMin = FLT_MAX, yMax = -FLT_MAX, zMin = FLT_MAX, zMax = -FLT_MAX;
+
+    #pragma omp parallel for reduction(min:xMin,yMin,zMin) reduction(max:xMax,yMax,zMax)
+    for(long i=0; i<last - first; i++)
+    {
+        xMin = std::min(xMin, slice[i].x); xMax = std::max(xMax, slice[i].x);
+        yMin = std::min(yMin, slice[i].y); yMax = std::max(yMax, slice[i].y);
+        zMin = std::min(zMin, slice[i].z); zMax = std::max(zMax, slice[i].z);
+    }
+
+    float localMin[3] = {xMin, yMin, zMin}, localMax[3] = {xMax, yMax, zMax};
+    float globalMin[3], globalMax[3];
+    mpi::all_reduce(this->world, localMin, 3, globalMin, mpi::minimum<float>());
+    mpi::all_reduce(this->world, localMax, 3, globalMax, mpi::maximum<float>());
+
+    #pragma omp parallel for
+    for(long i=0; i<last - first; i++)
+    {
+        slice[i].scale(COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, globalMin[0], globalMax[0], globalMin[1], globalMax[1], globalMin[2], globalMax[2]);
+    }
+
+    // Assemble the slices on all processes, or send the particles to the owners of their domains.
+    if(DISTRIBUTED_OWNERSHIP)
+    {
+        this->migrateParticles();
+    }
+    else
+    {
+        this->allGatherParticles();
+    }
+}
+
+
+Simulation::Simulation(MPI_Comm comm, ParticleView& view) : world(comm, mpi::comm_duplicate)
+{
+    this->initialize(view.count);
+
+    long first, last;
+    this->nodeCommunicator->processRange(view.count, first, last);
+    Particle* slice = &this->particles[DISTRIBUTED_OWNERSHIP ? 0 : first];
+
+    for(long i = first; i < last; i++)
+    {
+        slice[i - first] = Particle(view.x[i], view.y[i], view.z[i], view.vX[i], view.vY[i], view.vZ[i], view.mass[i]);
+    }
+
+    if(DISTRIBUTED_OWNERSHIP)
+    {
+        this->migrateParticles();
+    }
+    else
+    {
+        this->allGatherParticles();
+    }
+}
+
+
+Simulation::~Simulation()
+{
+    this->sharedParticleIndices.free();
+    this->sharedCellInts.free();
+    this->sharedCellFloats.free();
+    this->particles.free();
+
+    MPI_Type_free(&this->particleType);
+    delete this->nodeCommunicator;
+}
+
+
+// Advances the simulation by n steps.
+void Simulation::step(long n)
+{
+    // The thread count is set by the thread running the steps, which isn't always the one which created the simulation.
+    if(this->threadCount > 0)
+    {
+        omp_set_num_threads(this->threadCount);
+    }
+
+    for(long i=0; i<n; i++)
+    {
+        this->diagnosticsComputed = this->stepCount % DIAGNOSTICS_INTERVAL == 0;
+        this->simulate(this->diagnosticsComputed);
+        this->stepCount++;
+
+        double phaseStart = this->startPhases();
+        if(ANALYSIS_INTERVAL > 0 && this->stepCount % ANALYSIS_INTERVAL == 0)
+        {
+            this->analyze();
+        }
+        this->endPhase(ANALYSIS_PHASE, phaseStart);
+    }
+}
+
+
+// Computes the analysis products from the particles of all the processes, and writes them from the main process
+// to analysis_<step>_density.txt and analysis_<step>_profile.csv.
+void Simulation::analyze()
+{
+    long first, last;
+    this->ownedRange(first, last);
+
+    this->analysis.compute(this->particles.data(), first, last, this->rootBounds, this->world);
+
+    if(this->world.rank() == 0)
+    {
+        this->analysis.write("analysis_" + std::to_string(this->stepCount));
+    }
+}
+
+
+// Copies the particles into the view, which has to have room for all of them.
+// With distributed ownership, only the particles owned by this process are copied.
+void Simulation::getParticles(ParticleView& view)
+{
+    view.count = DISTRIBUTED_OWNERSHIP ? this->ownedCount : this->particles.size();
+
+    #pragma omp parallel for
+    for(long i=0; i<view.count; i++)
+    {
+        view.x[i] = this->particles[i].x;
+        view.y[i] = this->particles[i].y;
+        view.z[i] = this->particles[i].z;
+        view.vX[i] = this->particles[i].vX;
+        view.vY[i] = this->particles[i].vY;
+        view.vZ[i] = this->particles[i].vZ;
+        view.mass[i] = this->particles[i].mass;
+    }
+}
+
+
+// Writes a compressed snapshot of the particles, each process encoding its own range.
+void Simulation::writeSnapshot(const std::string& path)
+{
+    long first, last;
+    this->ownedRange(first, last);
+
+    Snapshot snapshot;
+    snapshot.encode(&this->particles[first], last - first);
+    snapshot.write(this->world, path);
+}
+
+
+// Range [first, last) of the particles this process advances: its slice of all the particles, or the ones it owns.
+void Simulation::ownedRange(long& first, long& last)
+{
+    if(DISTRIBUTED_OWNERSHIP)
+    {
+        first = 0;
+        last = this->ownedCount;
+    }
+    else
+    {
+        this->nodeCommunicator->processRange(this->particles.size(), first, last);
+    }
+}
+
+
+// Sends outgoing[rank] to every other process, and receives the particles sent to this one.
+void Simulation::exchangeParticles(std::vector<std::vector<Particle>>& outgoing, std::vector<Particle>& incoming)
+{
+    int processCount = this->world.size();
+
+    std::vector<int> sendCounts(processCount), receiveCounts(processCount), receiveOffsets(processCount, 0);
+    for(int i=0; i<processCount; i++)
+    {
+        sendCounts[i] = (int)outgoing[i].size();
+    }
+    MPI_Alltoall(sendCounts.data(), 1, MPI_INT, receiveCounts.data(), 1, MPI_INT, this->world);
+
+    for(int i=1; i<processCount; i++)
+    {
+        receiveOffsets[i] = receiveOffsets[i - 1] + receiveCounts[i - 1];
+    }
+    incoming.resize(receiveOffsets[processCount - 1] + receiveCounts[processCount - 1]);
+
+    // Only the processes which have something to exchange communicate.
+    std::vector<MPI_Request> requests;
+    for(int i=0; i<processCount; i++)
+    {
+        if(receiveCounts[i] > 0)
+        {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Irecv(&incoming[receiveOffsets[i]], receiveCounts[i], this->particleType, i, 0, this->world, &requests.back());
+        }
+    }
+    for(int i=0; i<processCount; i++)
+    {
+        if(sendCounts[i] > 0)
+        {
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(outgoing[i].data(), sendCounts[i], this->particleType, i, 0, this->world, &requests.back());
+        }
+    }
+
+    MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+}
+
+
+// Rebalances the domains, and sends the owned particles out of this process' domain to their new owners.
+// The particles imported for the last step are dropped.
+void Simulation::migrateParticles()
+{
+    this->computeRootBounds();
+    this->domains.balance(this->particles.data(), this->ownedCount, this->rootBounds, this->world);
+
+    int rank = this->world.rank();
+    std::vector<std::vector<Particle>> outgoing(this->world.size());
+    std::vector<Particle> kept, incoming;
+
+    for(long i=0; i<this->ownedCount; i++)
+    {
+        int owner = this->domains.owner(DomainDecomposition::key(this->particles[i], this->rootBounds));
+        if(owner == rank)
+        {
+            kept.push_back(this->particles[i]);
+        }
+        else
+        {
+            outgoing[owner].push_back(this->particles[i]);
+        }
+    }
+
+    this->exchangeParticles(outgoing, incoming);
+
+    this->ownedCount = (long)(kept.size() + incoming.size());
+    this->particles.resize(*this->nodeCommunicator, this->ownedCount);
+    std::copy(kept.begin(), kept.end(), this->particles.data());
+    std::copy(incoming.begin(), incoming.end(), this->particles.data() + kept.size());
+}
+
+
+// Sets the root cell to the smallest cube holding the particles of all the processes, from a reduction of their bounds.
+// Keeps the coordinate range without ADAPTIVE_ROOT_BOUNDS or with PERIODIC_BOUNDARIES.
+void Simulation::computeRootBounds()
+{
+    if(!ADAPTIVE_ROOT_BOUNDS || PERIODIC_BOUNDARIES)
+    {
+        return;
+    }
+
+    long first, last;
+    this->ownedRange(first, last);
+
+    float xMin = FLT_MAX, xMax = -FLT_MAX, yMin = FLT_MAX, yMax = -FLT_MAX, zMin = FLT_MAX, zMax = -FLT_MAX;
+
+    #pragma omp parallel for reduction(min:xMin,yMin,zMin) reduction(max:xMax,yMax,zMax)
+    for(long i=first; i<last; i++)
+    {
+        xMin = std::min(xMin, this->particles[i].x); xMax = std::max(xMax, this->particles[i].x);
+        yMin = std::min(yMin, this->particles[i].y); yMax = std::max(yMax, this->particles[i].y);
+        zMin = std::min(zMin, this->particles[i].z); zMax = std::max(zMax, this->particles[i].z);
+    }
+
+    float localMin[3] = {xMin, yMin, zMin}, localMax[3] = {xMax, yMax, zMax};
+    float globalMin[3], globalMax[3];
+    mpi::all_reduce(this->world, localMin, 3, globalMin, mpi::minimum<float>());
+    mpi::all_reduce(this->world, localMax, 3, globalMax, mpi::maximum<float>());
+
+    // Cells have to be cubes, since the opening criteria take their size along x. The cube is widened a little, so that
+    // the particles on its lower faces, which cells exclude, are still inside it.
+    float size = std::max(std::max(globalMax[0] - globalMin[0], globalMax[1] - globalMin[1]), globalMax[2] - globalMin[2]);
+    float halfSize = size > 0 ? size * 0.501f : 1;
+
+    for(int axis=0; axis<3; axis++)
+    {
+        float center = globalMin[axis] <= globalMax[axis] ? (globalMin[axis] + globalMax[axis]) / 2 : 0;
+        this->rootBounds[2 * axis] = center - halfSize;
+        this->rootBounds[2 * axis + 1] = center + halfSize;
+    }
+}
+
+
+// Builds the tree of this process' particles and of the parts of the other domains they interact with.
+// Every process walks the tree of its own particles for each other domain, and sends the cells far enough from the
+// whole domain as pseudo-particles at their centers of mass, and the particles of the leaves close to it. These
+// locally essential trees are appended to the owned particles, the real copies before the pseudo-particles, and the
+// tree is built from all of them.
+void Simulation::buildDistributedTree(double& phaseStart)
+{
+    const int F = SerializedCell::FLOATS_PER_CELL;
+    const int I = SerializedCell::INTS_PER_CELL;
+    int processCount = this->world.size();
+    int rank = this->world.rank();
+
+    // The distributed trees are always built by all the threads together.
+    this->branchTree.build(this->rootBounds[0], this->rootBounds[1], this->rootBounds[2], this->rootBounds[3], this->rootBounds[4], this->rootBounds[5], this->particles.data(), this->ownedCount);
+    this->branchTree.serialize(this->ownedTree);
+    this->ownedTree.particleVector = this->particles.data();
+    this->ownedTree.omega = this->tree.omega;
+    this->ownedTree.computeCenterOffsets();
+
+    // Bounds of this domain's particles, empty when it has none.
+    float xMin = FLT_MAX, xMax = -FLT_MAX, yMin = FLT_MAX, yMax = -FLT_MAX, zMin = FLT_MAX, zMax = -FLT_MAX;
+
+    #pragma omp parallel for reduction(min:xMin,yMin,zMin) reduction(max:xMax,yMax,zMax)
+    for(long i=0; i<this->ownedCount; i++)
+    {
+        xMin = std::min(xMin, this->particles[i].x); xMax = std::max(xMax, this->particles[i].x);
+        yMin = std::min(yMin, this->particles[i].y); yMax = std::max(yMax, this->particles[i].y);
+        zMin = std::min(zMin, this->particles[i].z); zMax = std::max(zMax, this->particles[i].z);
+    }
+
+    this->endPhase(BUILD_PHASE, phaseStart);
+
+    float bounds[6] = {xMin, xMax, yMin, yMax, zMin, zMax};
+    std::vector<float> domainBounds(6 * processCount);
+    MPI_Allgather(bounds, 6, MPI_FLOAT, domainBounds.data(), 6, MPI_FLOAT, this->world);
+
+    std::vector<std::vector<Particle>> outgoing(processCount), outgoingCells(processCount);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int process=0; process<processCount; process++)
+    {
+        if(process == rank || domainBounds[6 * process] > domainBounds[6 * process + 1])
+        {
+            continue;
+        }
+
+        // Cells within CLOSE_PAIR_DISTANCE of the other domain are always opened, so that both owners of a close pair
+        // see it between real particles.
+        float otherBounds[6];
+        for(int k=0; k<6; k++)
+        {
+            otherBounds[k] = domainBounds[6 * process + k] + (k % 2 == 0 ? -CLOSE_PAIR_DISTANCE : CLOSE_PAIR_DISTANCE);
+        }
+
+        long cell = 0;
+        while(cell < this->ownedTree.cellCount)
+        {
+            float* cellFloats = &this->ownedTree.serializedCellMatrixFloats[cell * F];
+            int* cellInts = &this->ownedTree.serializedCellMatrixInts[cell * I];
+
+            if(cellInts[0] == 0)
+            {
+                cell = cellInts[2];
+            }
+            else if(this->ownedTree.isFarEnoughFromBoundsToUseAsCluster(cell, otherBounds))
+            {
+                outgoingCells[process].push_back(Particle(cellFloats[6], cellFloats[7], cellFloats[8], 0, 0, 0, cellFloats[9]));
+                cell = cellInts[2];
+            }
+            else if(this->ownedTree.isLeaf(cell))
+            {
+                for(int j=0; j<cellInts[0]; j++)
+                {
+                    outgoing[process].push_back(this->particles[this->ownedTree.serializedParticleIndices[cellInts[1] + j]]);
+                }
+                cell = cellInts[2];
+            }
+            else
+            {
+                cell++;
+            }
+        }
+    }
+
+    // Every sender's block holds its real particles first, followed by its pseudo-particles.
+    std::vector<int> sentCounts(2 * processCount), receivedCounts(2 * processCount);
+    for(int process=0; process<processCount; process++)
+    {
+        sentCounts[2 * process] = (int)outgoing[process].size();
+        sentCounts[2 * process + 1] = (int)outgoingCells[process].size();
+        outgoing[process].insert(outgoing[process].end(), outgoingCells[process].begin(), outgoingCells[process].end());
+    }
+    MPI_Alltoall(sentCounts.data(), 2, MPI_INT, receivedCounts.data(), 2, MPI_INT, this->world);
+
+    std::vector<Particle> incoming;
+    this->exchangeParticles(outgoing, incoming);
+
+    // Move the real particles of all the senders in front of the pseudo-particles.
+    std::vector<Particle> imported;
+    imported.reserve(incoming.size());
+    this->importOffsets.assign(processCount + 1, 0);
+    long offset = 0;
+    for(int process=0; process<processCount; process++)
+    {
+        imported.insert(imported.end(), incoming.begin() + offset, incoming.begin() + offset + receivedCounts[2 * process]);
+        offset += receivedCounts[2 * process] + receivedCounts[2 * process + 1];
+        this->importOffsets[process + 1] = (long)imported.size();
+    }
+    this->importedCount = (long)imported.size();
+    offset = 0;
+    for(int process=0; process<processCount; process++)
+    {
+        offset += receivedCounts[2 * process];
+        imported.insert(imported.end(), incoming.begin() + offset, incoming.begin() + offset + receivedCounts[2 * process + 1]);
+        offset += receivedCounts[2 * process + 1];
+    }
+
+    // Append the imported particles after the owned ones, which have to be kept when the vector grows.
+    long total = this->ownedCount + (long)imported.size();
+    if(total > this->particles.capacity)
+    {
+        std::vector<Particle> owned(this->particles.data(), this->particles.data() + this->ownedCount);
+        this->particles.resize(*this->nodeCommunicator, total);
+        std::copy(owned.begin(), owned.end(), this->particles.data());
+    }
+    else
+    {
+        this->particles.resize(*this->nodeCommunicator, total);
+    }
+    std::copy(imported.begin(), imported.end(), this->particles.data() + this->ownedCount);
+
+    this->treeBroadcastBytes = (long)(imported.size() * sizeof(Particle));
+    this->treeDecodeTime = 0;
+
+    this->endPhase(GATHER_PHASE, phaseStart);
+
+    this->branchTree.build(this->rootBounds[0], this->rootBounds[1], this->rootBounds[2], this->rootBounds[3], this->rootBounds[4], this->rootBounds[5], this->particles.data(), this->particles.size());
+    this->branchTree.serialize(this->distributedTree);
+    this->uncompressedTreeBytes = this->distributedTree.memoryBytes();
+
+    this->tree.cellCount = this->distributedTree.cellCount;
+    this->tree.particleIndexCount = this->distributedTree.particleIndexCount;
+    this->tree.serializedCellMatrixFloats = this->distributedTree.serializedCellMatrixFloats;
+    this->tree.serializedCellMatrixInts = this->distributedTree.serializedCellMatrixInts;
+    this->tree.serializedParticleIndices = this->distributedTree.serializedParticleIndices;
+    this->tree.particleVector = this->particles.data();
+    this->tree.computeCenterOffsets();
+}
+
+
+// Run a simulation step.
+// The diagnostics are accumulated during the force walk, from the positions and velocities at the start of the step.
+void Simulation::simulate(bool computeDiagnostics)
+{
+    double phaseStart = this->startPhases();
+
+    // Every process updates its own range of the particles.
+    long first, last;
+    this->ownedRange(first, last);
+
+    // The distributed tree is rebuilt from different particles every step, so its lists can't be kept.
+    // The lists are built without the periodic images either.
+    bool cacheLists = INTERACTION_LIST_CACHING && !DISTRIBUTED_OWNERSHIP && !PERIODIC_BOUNDARIES;
+
+    // While the interaction lists are valid, the tree keeps its cells and only their centers of mass follow the particles.
+    if(cacheLists && this->interactionCache.isValid(this->listDisplacement))
+    {
+        if(this->nodeCommunicator->isLeader())
+        {
+            this->tree.refit();
+        }
+        this->sharedCellFloats.synchronize();
+        this->tree.computeCenterOffsets();
+
+        this->phaseTimes[BUILD_PHASE] = 0;
+        this->phaseTimes[GATHER_PHASE] = 0;
+        std::fill(this->phaseCounters[BUILD_PHASE], this->phaseCounters[BUILD_PHASE] + HARDWARE_COUNTER_COUNT, 0);
+        std::fill(this->phaseCounters[GATHER_PHASE], this->phaseCounters[GATHER_PHASE] + HARDWARE_COUNTER_COUNT, 0);
+        this->endPhase(BROADCAST_PHASE, phaseStart);
+
+        this->interactionCache.age++;
+        this->listCacheHits++;
+        this->listCacheTimeSaved += this->treeBuildTime - this->phaseTimes[BROADCAST_PHASE];
+    }
+    else
+    {
+        this->computeRootBounds();
+
+        if(DISTRIBUTED_OWNERSHIP)
+        {
+            this->buildDistributedTree(phaseStart);
+        }
+        else
+        {
+            this->buildTree(phaseStart);
+        }
+
+        if(cacheLists)
+        {
+            this->interactionCache.build(this->tree, first, last);
+            this->listCacheMisses++;
+        }
+
+        this->endPhase(BROADCAST_PHASE, phaseStart);
+        this->treeBuildTime = this->phaseTimes[BUILD_PHASE] + this->phaseTimes[GATHER_PHASE] + this->phaseTimes[BROADCAST_PHASE];
+    }
+
+    NeighborSearch neighborSearch(&this->tree);
+    // The pseudo-particles of the distributed trees are no neighbors.
+    if(DISTRIBUTED_OWNERSHIP)
+    {
+        neighborSearch.particleCount = this->ownedCount + this->importedCount;
+    }
+
+    // Scale the softening of every particle by its neighbor distance relative to the mean one, so that denser regions get
+    // shorter lengths while the average stays at FORCE_SOFTENING.
+    // The pair interactions need the softening of both particles, so the adapted lengths are exchanged before the walk.
+    if(ADAPTIVE_SOFTENING)
+    {
+        std::vector<float> distances(last - first);
+        neighborSearch.nearestDistances(first, last, SOFTENING_NEIGHBORS, distances.data());
+
+        double distanceSum[2] = {0, 0}, totalDistanceSum[2];
+        for(long i = first; i < last; i++)
+        {
+            if(distances[i - first] > 0)
+            {
+                distanceSum[0] += distances[i - first];
+                distanceSum[1]++;
+            }
+        }
+        mpi::all_reduce(this->world, distanceSum, 2, totalDistanceSum, std::plus<double>());
+        double meanDistance = totalDistanceSum[0] / totalDistanceSum[1];
+
+        for(long i = first; i < last; i++)
+        {
+            this->particles[i].softening = distances[i - first] > 0 ? (float)(FORCE_SOFTENING * distances[i - first] / meanDistance) : FORCE_SOFTENING;
+        }
+
+        // The imported copies keep the softening of the previous step.
+        if(!DISTRIBUTED_OWNERSHIP)
+        {
+            this->allGatherParticles();
+        }
+    }
+
+    // Every particle only changes its own velocity, so the walks run in parallel.
+    long cellInteractions = 0, particleInteractions = 0;
+    double diagnostics[DIAGNOSTICS_COUNT] = {0};
+
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:cellInteractions,particleInteractions,diagnostics[:DIAGNOSTICS_COUNT])
+    for(long i = first; i < last; i++)
+    {
+        float vX = this->particles[i].vX, vY = this->particles[i].vY, vZ = this->particles[i].vZ;
+        double potential = 0;
+
+        if(cacheLists)
+        {
+            this->interactWithLists(i, potential, computeDiagnostics, cellInteractions, particleInteractions);
+        }
+        else
+        {
+            this->walkTree(i, potential, computeDiagnostics, cellInteractions, particleInteractions);
+        }
+
+        // Keep the acceleration for the opening criterion of the next step.
+        float dvX = this->particles[i].vX - vX, dvY = this->particles[i].vY - vY, dvZ = this->particles[i].vZ - vZ;
+        this->particles[i].acceleration = std::sqrt(dvX*dvX + dvY*dvY + dvZ*dvZ) / TIMESTEP;
+
+        if(computeDiagnostics)
+        {
+            double m = this->particles[i].mass, x = this->particles[i].x, y = this->particles[i].y, z = this->particles[i].z;
+
+            diagnostics[0] += 0.5 * m * ((double)vX*vX + (double)vY*vY + (double)vZ*vZ);
+            // Every pair is seen from both of its particles.
+            diagnostics[1] += 0.5 * potential;
+            diagnostics[2] += m * vX;
+            diagnostics[3] += m * vY;
+            diagnostics[4] += m * vZ;
+            diagnostics[5] += m * (y * vZ - z * vY);
+            diagnostics[6] += m * (z * vX - x * vZ);
+            diagnostics[7] += m * (x * vY - y * vX);
+        }
+    }
+
+    this->cellInteractions = cellInteractions;
+    this->particleInteractions = particleInteractions;
+    std::copy(diagnostics, diagnostics + DIAGNOSTICS_COUNT, this->diagnostics);
+
+    if(computeDiagnostics)
+    {
+        std::vector<std::pair<int, int>> closePairs;
+        this->closePairCount = neighborSearch.closePairs(first, last, CLOSE_PAIR_DISTANCE, closePairs);
+
+        // A pair with an imported particle is also found by the process owning it, and is only counted by the lower rank.
+        if(DISTRIBUTED_OWNERSHIP)
+        {
+            int rank = this->world.rank();
+            this->closePairCount -= std::count_if(closePairs.begin(), closePairs.end(), [this, rank](std::pair<int, int>& pair)
+            {
+                if(pair.second < this->ownedCount)
+                {
+                    return false;
+                }
+                long owner = std::upper_bound(this->importOffsets.begin(), this->importOffsets.end(), pair.second - this->ownedCount) - this->importOffsets.begin() - 1;
+                return owner < rank;
+            });
+        }
+    }
+
+    this->endPhase(FORCE_PHASE, phaseStart);
+
+    // Wait for the other processes of the node to finish reading the positions before updating them.
+    this->particles.synchronize();
+
+    for(long i = first; i < last; i++)
+    {
+        this->particles[i].updatePosition(TIMESTEP);
+
+        // Particles leaving the periodic box come back on the other side.
+        if(PERIODIC_BOUNDARIES)
+        {
+            this->particles[i].setCoordinates(wrapCoordinate(this->particles[i].x), wrapCoordinate(this->particles[i].y), wrapCoordinate(this->particles[i].z));
+        }
+    }
+
+    // Gather the particles updated by the other nodes, or send the ones which left the domain to their new owners.
+    if(DISTRIBUTED_OWNERSHIP)
+    {
+        this->migrateParticles();
+    }
+    else
+    {
+        this->allGatherParticles();
+    }
+
+    // All the processes have to agree on reusing the lists, so the largest displacement is over all of them.
+    if(cacheLists)
+    {
+        mpi::all_reduce(this->world, this->interactionCache.maxDisplacement(), this->listDisplacement, mpi::maximum<float>());
+    }
+
+    this->endPhase(UPDATE_PHASE, phaseStart);
+}
+
+
+// Child of the cell holding the particle, in the order of Cell::expandChildren, whose upper children hold the middle planes.
+static int childOctant(Cell* cell, Particle* particle)
+{
+    int octant = 0;
+
+    if(particle->x > (cell->xMin + cell->xMax) / 2) octant |= 1;
+    if(particle->y > (cell->yMin + cell->yMax) / 2) octant |= 2;
+    if(particle->z > (cell->zMin + cell->zMax) / 2) octant |= 4;
+
+    return octant;
+}
+
+
+// Builds the tree from the branches of all the processes, and shares it with the processes of every node.
+void Simulation::buildTree(double& phaseStart)
+{
+    // First create the empty tree up to the second level (so that we have better potential for parallelism).
+    // This way we can scale up to 64 cores.
+    Cell *root = new Cell(this->rootBounds[0], this->rootBounds[1], this->rootBounds[2], this->rootBounds[3], this->rootBounds[4], this->rootBounds[5]);
+    root->expandChildren();
+
+    std::vector<Cell*> secondLevelCells;
+    for(int i=0; i<root->children.size(); i++)
+    {
+        root->children[i]->expandChildren();
+
+        for(int j=0; j<root->children[i]->children.size(); j++)
+        {
+            secondLevelCells.push_back(root->children[i]->children[j]);
+        }
+    }
+
+    // Split the second level cells among processes.
+    // We split in a round robin style because the particles tend to be grouped in a couple of regions.
+    // Thus, if adjacent regions are processed by different processes we'll have better parallelism.
+    std::vector<Cell*> cellsOfThisProcess;
+
+    for(int i = this->world.rank(); i < secondLevelCells.size(); i+=this->world.size())
+    {
+        cellsOfThisProcess.push_back(secondLevelCells[i]);
+    }
+
+    // With the concurrent build, the particles are first grouped by second-level cell, so that the build of a branch only
+    // visits its own particles instead of all of them. The ones outside the root are dropped by the branch builds.
+    std::vector<int> cellParticles;
+    std::vector<long> cellStart(secondLevelCells.size() + 1, 0);
+    if(CONCURRENT_TREE_BUILD)
+    {
+        long n = this->particles.size();
+        std::vector<int> cellOf(n);
+
+        #pragma omp parallel for
+        for(long j=0; j<n; j++)
+        {
+            int octant = childOctant(root, &this->particles[j]);
+            cellOf[j] = 8 * octant + childOctant(root->children[octant], &this->particles[j]);
+        }
+
+        for(long j=0; j<n; j++)
+        {
+            cellStart[cellOf[j] + 1]++;
+        }
+        for(size_t c=0; c<secondLevelCells.size(); c++)
+        {
+            cellStart[c + 1] += cellStart[c];
+        }
+
+        cellParticles.resize(n);
+        std::vector<long> cellFill(cellStart.begin(), cellStart.end() - 1);
+        for(long j=0; j<n; j++)
+        {
+            cellParticles[cellFill[cellOf[j]]++] = (int)j;
+        }
+    }
+
+    // Now it's time to assemble the partially constructed tress on the main process.
+    // Create a serialized structure to hold cellsOfThisProcess information.
+    std::vector<SerializedCell> serializedCellsOfThisProcess;
+
+    for(int i=0; i<cellsOfThisProcess.size(); i++)
+    {
+        Cell* cell = cellsOfThisProcess[i];
+        int cellIndex = this->world.rank() + i * this->world.size();
+        SerializedCell serializedCell;
+        serializedCell.particleVector = this->particles.data();
+
+        if(CONCURRENT_TREE_BUILD)
+        {
+            // All the threads insert the particles of the cell together.
+            this->branchTree.build(cell->xMin, cell->xMax, cell->yMin, cell->yMax, cell->zMin, cell->zMax, this->particles.data(), this->particles.size(),
+                                   cellParticles.data() + cellStart[cellIndex], cellStart[cellIndex + 1] - cellStart[cellIndex]);
+            this->branchTree.serialize(serializedCell);
+        }
+        else
+        {
+            // Trying to add a particle to the wrong cell of the tree is ignored, so we try to add all particles to the cell.
+            for(int j=0; j<this->particles.size(); j++)
+            {
+                cell->insertParticle(&this->particles[j]);
+            }
+            serializedCell.serializeTree(cell);
+        }
+
+        serializedCellsOfThisProcess.push_back(serializedCell);
+    }
+
+    this->endPhase(BUILD_PHASE, phaseStart);
+
+    // Gather the tree branches on the main process.
+    std::vector<std::vector<SerializedCell>> gatheredSecondLevelBranches;
+    mpi::gather(this->world, serializedCellsOfThisProcess, gatheredSecondLevelBranches, 0);
+
+    // Clear the old Cell data to clear up space for the new.
+    delete root;
+    secondLevelCells.clear();
+    cellsOfThisProcess.clear();
+
+    // Assemble the tree from the branches on the main process.
+    SerializedCell serializedRoot;
+
+    if(this->world.rank() == 0)
+    {
+        std::vector<SerializedCell*> secondLevelBranches(64);
+        for(int i=0; i<gatheredSecondLevelBranches.size(); i++)
+        {
+            for(int j=0; j<gatheredSecondLevelBranches[i].size(); j++)
+            {
+                secondLevelBranches[j * gatheredSecondLevelBranches.size() + i] = &gatheredSecondLevelBranches[i][j];
+            }
+        }
+
+        // The first two levels only provide the geometry of the assembled cells.
+        root = new Cell(this->rootBounds[0], this->rootBounds[1], this->rootBounds[2], this->rootBounds[3], this->rootBounds[4], this->rootBounds[5]);
+        root->expandChildren();
+        for(int i=0; i<root->children.size(); i++)
+        {
+            root->children[i]->expandChildren();
+        }
+
+        serializedRoot.assembleTree(root, secondLevelBranches);
+        delete root;
+    }
+
+    this->endPhase(GATHER_PHASE, phaseStart);
+
+    // Broadcast the newly built tree to the node leaders, in the compact format.
+    CompactTree compactRoot;
+
+    if(this->world.rank() == 0)
+    {
+        compactRoot.encode(serializedRoot, QUANTIZE_TREE_CENTERS);
+
+        this->uncompressedTreeBytes = serializedRoot.memoryBytes();
+    }
+
+    if(this->nodeCommunicator->isLeader())
+    {
+        this->treeBroadcastBytes = compactRoot.buffer.size();
+        MPI_Bcast(&this->treeBroadcastBytes, 1, MPI_LONG, 0, this->nodeCommunicator->leaders);
+        compactRoot.buffer.resize(this->treeBroadcastBytes);
+        compactRoot.trackMemory();
+        MPI_Bcast(compactRoot.buffer.data(), (int)this->treeBroadcastBytes, MPI_UNSIGNED_CHAR, 0, this->nodeCommunicator->leaders);
+
+        // With quantized centers the main process walks the decoded tree too, so that the forces don't depend on the node.
+        if(this->world.rank() != 0 || QUANTIZE_TREE_CENTERS)
+        {
+            boost::mpi::timer decodeTimer;
+            compactRoot.decode(serializedRoot);
+            this->treeDecodeTime = decodeTimer.elapsed();
+        }
+    }
+
+    // The leader copies the tree into the node's shared memory, the other processes of the node only read it.
+    long treeSize[2] = {serializedRoot.cellCount, serializedRoot.particleIndexCount};
+    MPI_Bcast(treeSize, 2, MPI_LONG, 0, this->nodeCommunicator->node);
+
+    this->sharedCellFloats.resize(*this->nodeCommunicator, treeSize[0] * SerializedCell::FLOATS_PER_CELL);
+    this->sharedCellInts.resize(*this->nodeCommunicator, treeSize[0] * SerializedCell::INTS_PER_CELL);
+    this->sharedParticleIndices.resize(*this->nodeCommunicator, treeSize[1]);
+
+    if(this->nodeCommunicator->isLeader())
+    {
+        std::copy(serializedRoot.serializedCellMatrixFloats, serializedRoot.serializedCellMatrixFloats + this->sharedCellFloats.size(), this->sharedCellFloats.data());
+        std::copy(serializedRoot.serializedCellMatrixInts, serializedRoot.serializedCellMatrixInts + this->sharedCellInts.size(), this->sharedCellInts.data());
+        std::copy(serializedRoot.serializedParticleIndices, serializedRoot.serializedParticleIndices + this->sharedParticleIndices.size(), this->sharedParticleIndices.data());
+    }
+
+    this->sharedCellFloats.synchronize();
+    this->sharedCellInts.synchronize();
+    this->sharedParticleIndices.synchronize();
+
+    // All processes walk the shared arrays directly.
+    this->tree.cellCount = treeSize[0];
+    this->tree.particleIndexCount = treeSize[1];
+    this->tree.serializedCellMatrixFloats = this->sharedCellFloats.data();
+    this->tree.serializedCellMatrixInts = this->sharedCellInts.data();
+    this->tree.serializedParticleIndices = this->sharedParticleIndices.data();
+    this->tree.particleVector = this->particles.data();
+    this->tree.computeCenterOffsets();
+}
+
+
+// Walks the tree for the interactions of the particle, adding its potential energy when computing the diagnostics, and
+// counting the interactions.
+void Simulation::walkTree(long i, double& potential, bool computeDiagnostics, long& cellInteractions, long& particleInteractions)
+{
+    // Stackless walk in pre-order. Opening a cell moves on to its first child, which is the next cell,
+    // while using a cell as a cluster or interacting with a leaf skips its subtree.
+    long cell = 0;
+
+    while(cell < this->tree.cellCount)
+    {
+        float* cellFloats = &this->tree.serializedCellMatrixFloats[cell * SerializedCell::FLOATS_PER_CELL];
+        int* cellInts = &this->tree.serializedCellMatrixInts[cell * SerializedCell::INTS_PER_CELL];
+
+        // Ignore empty cells
+        if(cellInts[0] == 0)
+        {
+            cell = cellInts[2];
+        }
+        else if(this->tree.isFarEnoughFromParticleToUseAsCluster(cell, &this->particles[i]))
+        {
+            float x = cellFloats[6], y = cellFloats[7], z = cellFloats[8];
+            if(PERIODIC_BOUNDARIES)
+            {
+                this->periodicCorrection(&this->particles[i], x, y, z, cellFloats[9], potential, computeDiagnostics);
+            }
+
+            this->particles[i].forcePush(x, y, z, cellFloats[9], this->particles[i].softening, TIMESTEP);
+            cellInteractions++;
+
+            if(computeDiagnostics)
+            {
+                potential += this->particles[i].potentialEnergy(x, y, z, cellFloats[9], this->particles[i].softening);
+            }
+            cell = cellInts[2];
+        }
+        else if(this->tree.isLeaf(cell))
+        {
+            Particle* particle = &this->particles[i];
+            bool holdsParticle = false;
+
+            // The Ewald correction is smooth, so the leaf's other particles get it once, at their center of mass,
+            // unless the leaf could reach half the box away from the particle, where their nearest images change sides.
+            float s = cellFloats[1] - cellFloats[0];
+            bool correctEach = PERIODIC_BOUNDARIES && (crossesHalfBox(particle->x - (cellFloats[0] + cellFloats[1]) / 2, s)
+                                                       || crossesHalfBox(particle->y - (cellFloats[2] + cellFloats[3]) / 2, s)
+                                                       || crossesHalfBox(particle->z - (cellFloats[4] + cellFloats[5]) / 2, s));
+
+            // Interact directly with the particles of an opened leaf.
+            for(int j=0; j<cellInts[0]; j++)
+            {
+                long particleIndex = this->tree.serializedParticleIndices[cellInts[1] + j];
+                if(particleIndex != i)
+                {
+                    Particle* other = &this->particles[particleIndex];
+                    float x = other->x, y = other->y, z = other->z;
+                    if(correctEach)
+                    {
+                        this->periodicCorrection(particle, x, y, z, other->mass, potential, computeDiagnostics);
+                    }
+                    else if(PERIODIC_BOUNDARIES)
+                    {
+                        x = particle->x - nearestImage(particle->x - x);
+                        y = particle->y - nearestImage(particle->y - y);
+                        z = particle->z - nearestImage(particle->z - z);
+                    }
+
+                    particle->forcePush(x, y, z, other->mass, std::max(particle->softening, other->softening), TIMESTEP);
+                    particleInteractions++;
+
+                    if(computeDiagnostics)
+                    {
+                        potential += particle->potentialEnergy(x, y, z, other->mass, std::max(particle->softening, other->softening));
+                    }
+                }
+                else
+                {
+                    holdsParticle = true;
+                }
+            }
+
+            if(PERIODIC_BOUNDARIES && !correctEach && cellInts[0] > (holdsParticle ? 1 : 0))
+            {
+                float mass = cellFloats[9];
+                float x = cellFloats[6] * mass, y = cellFloats[7] * mass, z = cellFloats[8] * mass;
+                if(holdsParticle)
+                {
+                    mass -= particle->mass;
+                    x -= particle->x * particle->mass;
+                    y -= particle->y * particle->mass;
+                    z -= particle->z * particle->mass;
+                }
+                x /= mass;
+                y /= mass;
+                z /= mass;
+
+                this->periodicCorrection(particle, x, y, z, mass, potential, computeDiagnostics);
+            }
+            cell = cellInts[2];
+        }
+        else
+        {
+            cell++;
+        }
+    }
+}
+
+
+// With periodic boundaries, moves a source of the particle's interactions to its image nearest to the particle, and
+// adds the Ewald correction for its other images to the particle's velocity, and to its potential energy.
+void Simulation::periodicCorrection(Particle* particle, float& x, float& y, float& z, float mass, double& potential, bool computeDiagnostics)
+{
+    float dx = nearestImage(particle->x - x), dy = nearestImage(particle->y - y), dz = nearestImage(particle->z - z);
+    x = particle->x - dx;
+    y = particle->y - dy;
+    z = particle->z - dz;
+
+    float force[3], correction;
+    this->ewald.correction(dx, dy, dz, force, correction);
+
+    particle->vX += TIMESTEP * G * mass * force[0];
+    particle->vY += TIMESTEP * G * mass * force[1];
+    particle->vZ += TIMESTEP * G * mass * force[2];
+
+    if(computeDiagnostics)
+    {
+        potential += (double)G * particle->mass * mass * correction;
+    }
+}
+
+
+// Interactions of the particle with the cached lists of its group.
+void Simulation::interactWithLists(long i, double& potential, bool computeDiagnostics, long& cellInteractions, long& particleInteractions)
+{
+    InteractionCache& cache = this->interactionCache;
+    Particle* particle = &this->particles[i];
+    int group = cache.groupOf[i - cache.first];
+
+    for(long k = cache.farStart[group]; k < cache.farStart[group + 1]; k++)
+    {
+        float* cellFloats = &this->tree.serializedCellMatrixFloats[cache.farCells[k] * SerializedCell::FLOATS_PER_CELL];
+
+        particle->forcePush(cellFloats[6], cellFloats[7], cellFloats[8], cellFloats[9], particle->softening, TIMESTEP);
+        cellInteractions++;
+
+        if(computeDiagnostics)
+        {
+            potential += particle->potentialEnergy(cellFloats[6], cellFloats[7], cellFloats[8], cellFloats[9], particle->softening);
+        }
+    }
+
+    for(long k = cache.nearStart[group]; k < cache.nearStart[group + 1]; k++)
+    {
+        long particleIndex = cache.nearParticles[k];
+        if(particleIndex != i)
+        {
+            Particle* other = &this->particles[particleIndex];
+
+            particle->forcePush(other, TIMESTEP);
+            particleInteractions++;
+
+            if(computeDiagnostics)
+            {
+                potential += particle->potentialEnergy(other->x, other->y, other->z, other->mass, std::max(particle->softening, other->softening));
+            }
+        }
+    }
+}
+
+
+// Returns the start time of the first phase, and takes the counter readings it starts from.
+// The counters are opened on the first call, from the thread which runs the steps.
+double Simulation::startPhases()
+{
+    if(this->countHardwareEvents && !this->countersOpened)
+    {
+        this->countersOpened = true;
+        if(!this->counters.open() && this->world.rank() == 0)
+        {
+            fprintf(stderr, "Hardware performance counters are unavailable, the phases are only timed\n");
+        }
+    }
+
+    this->counters.read(this->counterReadings);
+    return MPI_Wtime();
+}
+
+
+// Sets the time and the hardware counts of the phase which ends now, and starts the next one.
+void Simulation::endPhase(SimulationPhase phase, double& phaseStart)
+{
+    double now = MPI_Wtime();
+    this->phaseTimes[phase] = now - phaseStart;
+    phaseStart = now;
+
+    if(this->counters.available)
+    {
+        double readings[HARDWARE_COUNTER_COUNT];
+        this->counters.read(readings);
+
+        for(int i=0; i<HARDWARE_COUNTER_COUNT; i++)
+        {
+            this->phaseCounters[phase][i] = readings[i] - this->counterReadings[i];
+            this->counterReadings[i] = readings[i];
+        }
+    }
+}
+
+
+const char* Simulation::phaseName(SimulationPhase phase)
+{
+    switch(phase)
+    {
+        case BUILD_PHASE: return "build";
+        case GATHER_PHASE: return "gather";
+        case BROADCAST_PHASE: return "broadcast";
+        case FORCE_PHASE: return "forces";
+        case UPDATE_PHASE: return "update";
+        case ANALYSIS_PHASE: return "analysis";
+        default: return "";
+    }
+}
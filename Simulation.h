@@ -0,0 +1,162 @@
+#ifndef NBODY_SIMULATION_H
+#define NBODY_SIMULATION_H
+
+#include "common.h"
+#include "Particle.h"
+#include "NodeCommunicator.h"
+#include "SharedArray.h"
+#include "ConcurrentTree.h"
+#include "SerializedCell.h"
+#include "InteractionCache.h"
+#include "Snapshot.h"
+#include "Analysis.h"
+#include "DomainDecomposition.h"
+#include "PerformanceCounters.h"
+#include "EwaldTable.h"
+#include <string>
+#include <vector>
+#include <mpi.h>
+#include <boost/mpi.hpp>
+
+
+// Phases of a step, timed separately.
+enum SimulationPhase {
+    // Building and serializing this process' branches, or the tree of its own particles.
+    BUILD_PHASE,
+    // Gathering the branches and assembling the tree on the main process, or exchanging the parts of the trees
+    // the other processes need.
+    GATHER_PHASE,
+    // Broadcasting the tree and copying it to the node's shared memory, or building the tree of the owned and
+    // imported particles.
+    BROADCAST_PHASE,
+    // Walking the tree for the forces.
+    FORCE_PHASE,
+    // Moving the particles and exchanging them between nodes or domains.
+    UPDATE_PHASE,
+    // Computing and writing the analysis products, on the steps which have them.
+    ANALYSIS_PHASE,
+    PHASE_COUNT
+};
+
+
+// Particles stored as separate arrays, one per field.
+struct ParticleView {
+    long count;
+    float *x, *y, *z;
+    float *vX, *vY, *vZ;
+    float *mass;
+};
+
+
+// The n-body solver, without any rendering or logging.
+// All the processes of the communicator take part in every call. The particles and the broadcast tree
+// are shared by the processes of a node, and every process advances its own range of the particles.
+//
+// With DISTRIBUTED_OWNERSHIP, every process is a node of its own and only holds the particles of its domain, first,
+// followed by the particles and pseudo-particles imported from the other domains for the step. The tree is built from
+// both, and the particles which left the domain after the update migrate to their new owners.
+class Simulation {
+public:
+    friend class Tuner;
+
+    static const int DIAGNOSTICS_COUNT = 8;
+
+    boost::mpi::communicator world;
+    NodeCommunicator* nodeCommunicator;
+    MPI_Datatype particleType;
+    SharedArray<Particle> particles;
+    SharedArray<float> sharedCellFloats;
+    SharedArray<int> sharedCellInts;
+    SharedArray<int> sharedParticleIndices;
+    // Reused by the builds of this process' branches.
+    ConcurrentTree branchTree;
+    // View on the node's shared tree, or on the distributed tree.
+    SerializedCell tree;
+    // Bounds of the tree's root cell: xMin, xMax, yMin, yMax, zMin, zMax.
+    float rootBounds[6] = {COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE};
+    // With distributed ownership: the owned particles at the start of the vector, the domains, the tree of the owned
+    // particles and the tree of the owned and imported ones.
+    long ownedCount = 0;
+    // The imported copies of real particles follow the owned ones, grouped by sender from importOffsets on, and the
+    // pseudo-particles of the far cells come last.
+    long importedCount = 0;
+    std::vector<long> importOffsets;
+    DomainDecomposition domains;
+    SerializedCell ownedTree;
+    SerializedCell distributedTree;
+    InteractionCache interactionCache;
+    // Products of the last analysis.
+    Analysis analysis;
+    // Corrections for the periodic images, with PERIODIC_BOUNDARIES.
+    EwaldTable ewald;
+
+    // Number of steps done so far.
+    long stepCount = 0;
+    // Threads of the parallel regions of every step, or 0 for the OpenMP default.
+    int threadCount = 0;
+
+    // Performance of the last step, for this process.
+    long treeBroadcastBytes = 0;
+    long uncompressedTreeBytes = 0;
+    double treeDecodeTime = 0;
+    long cellInteractions = 0;
+    long particleInteractions = 0;
+    double phaseTimes[PHASE_COUNT];
+
+    // Hardware counts of every phase of the last step, for this process. Counted when countHardwareEvents is set, from
+    // the first step on, if the counters could be opened.
+    bool countHardwareEvents = PERFORMANCE_COUNTERS;
+    PerformanceCounters counters;
+    double phaseCounters[PHASE_COUNT][HARDWARE_COUNTER_COUNT] = {};
+
+    // Steps which reused or rebuilt the interaction lists, and the tree build time saved by reusing them.
+    long listCacheHits = 0;
+    long listCacheMisses = 0;
+    double listCacheTimeSaved = 0;
+    // Time spent building the tree and the lists the last time, and the largest displacement of a particle since.
+    double treeBuildTime = 0;
+    float listDisplacement = 0;
+
+    // Diagnostics of this process' particles: kinetic energy, potential energy, momentum and angular momentum,
+    // and the close pairs found from them. Computed every DIAGNOSTICS_INTERVAL steps.
+    double diagnostics[DIAGNOSTICS_COUNT];
+    long closePairCount = 0;
+    // Whether the last step computed the diagnostics.
+    bool diagnosticsComputed = false;
+
+    void step(long);
+    void getParticles(ParticleView&);
+    void writeSnapshot(const std::string&);
+    void ownedRange(long&, long&);
+    static const char* phaseName(SimulationPhase);
+
+    // Plummer sphere of the given number of particles, generated from the seed, with the given scale length.
+    // The opening angle can differ from OMEGA, for parameter sweeps.
+    Simulation(MPI_Comm, long, unsigned long, float = OMEGA, int = SOFTENING_LENGTH);
+    // Particles copied from the view. Every process passes the same particles.
+    Simulation(MPI_Comm, ParticleView&);
+    Simulation(const Simulation&) = delete;
+    ~Simulation();
+
+private:
+    void initialize(long);
+    void allGatherParticles();
+    void exchangeParticles(std::vector<std::vector<Particle>>&, std::vector<Particle>&);
+    void migrateParticles();
+    void computeRootBounds();
+    void buildDistributedTree(double&);
+    void simulate(bool);
+    void buildTree(double&);
+    void walkTree(long, double&, bool, long&, long&);
+    void interactWithLists(long, double&, bool, long&, long&);
+    void periodicCorrection(Particle*, float&, float&, float&, float, double&, bool);
+    void analyze();
+    double startPhases();
+    void endPhase(SimulationPhase, double&);
+
+    bool countersOpened = false;
+    double counterReadings[HARDWARE_COUNTER_COUNT] = {};
+};
+
+
+#endif
@@ -0,0 +1,522 @@
+#include "Snapshot.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+
+
+static const char MAGIC[8] = {'N', 'B', 'S', 'N', 'A', 'P', '0', '1'};
+// Magic, chunk count, particle count.
+static const long HEADER_BYTES = 8 + 2 * sizeof(int64_t);
+// Offset, bytes, count, origin, position and velocity steps, bounds, integer masses.
+static const long INDEX_ENTRY_BYTES = 3 * sizeof(int64_t) + 11 * sizeof(float) + 1;
+// Largest quantized coordinate, on 21 bits so that the 3 coordinates fit a 64 bit Morton code.
+static const double MAX_GRID_COORDINATE = (1 << 21) - 1;
+// Largest write of a single MPI-IO call.
+static const long MAX_WRITE_BYTES = 1L << 30;
+
+
+template<class T>
+static void writeValue(std::vector<unsigned char>& buffer, T value)
+{
+    size_t offset = buffer.size();
+    buffer.resize(offset + sizeof(T));
+    memcpy(&buffer[offset], &value, sizeof(T));
+}
+
+
+template<class T>
+static T readValue(const std::vector<unsigned char>& buffer, size_t& offset)
+{
+    T value;
+    memcpy(&value, &buffer[offset], sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+
+// Writes the value 7 bits at a time, with the high bit set on every byte but the last.
+static void writeVarint(std::vector<unsigned char>& buffer, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        buffer.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back((unsigned char)value);
+}
+
+
+static uint64_t readVarint(const std::vector<unsigned char>& buffer, size_t& offset)
+{
+    uint64_t value = 0;
+    for(int shift = 0; ; shift += 7)
+    {
+        unsigned char byte = buffer[offset++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if(byte < 0x80)
+        {
+            return value;
+        }
+    }
+}
+
+
+// Maps signed values to unsigned ones, small magnitudes first: 0, -1, 1, -2, 2...
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+// Inverse of the bit spreading of mortonCode, for one coordinate.
+static uint32_t compactBits(uint64_t value)
+{
+    value &= 0x1249249249249249ULL;
+    value = (value ^ (value >> 2)) & 0x10c30c30c30c30c3ULL;
+    value = (value ^ (value >> 4)) & 0x100f00f00f00f00fULL;
+    value = (value ^ (value >> 8)) & 0x1f0000ff0000ffULL;
+    value = (value ^ (value >> 16)) & 0x1f00000000ffffULL;
+    value = (value ^ (value >> 32)) & 0x1fffff;
+    return (uint32_t)value;
+}
+
+
+static bool overlaps(const float* a, const float* b)
+{
+    return a[0] <= b[1] && b[0] <= a[1] && a[2] <= b[3] && b[2] <= a[3] && a[4] <= b[5] && b[4] <= a[5];
+}
+
+
+static bool contains(const float* bounds, Particle& particle)
+{
+    return bounds[0] <= particle.x && particle.x <= bounds[1]
+           && bounds[2] <= particle.y && particle.y <= bounds[3]
+           && bounds[4] <= particle.z && particle.z <= bounds[5];
+}
+
+
+// Encodes the particles in the given order, with their Morton codes.
+static void encodeChunk(SnapshotChunk& chunk, Particle* particles, std::pair<uint64_t, long>* order)
+{
+    chunk.integerMasses = MAX_MASS - MIN_MASS <= UINT8_MAX;
+    for(long i=0; i<chunk.count; i++)
+    {
+        float mass = particles[order[i].second].mass;
+        if(mass != std::floor(mass) || mass < MIN_MASS || mass > MAX_MASS)
+        {
+            chunk.integerMasses = false;
+        }
+    }
+
+    for(int axis=0; axis<3; axis++)
+    {
+        chunk.bounds[axis*2] = INFINITY;
+        chunk.bounds[axis*2 + 1] = -INFINITY;
+    }
+
+    uint64_t previousCode = 0;
+    int64_t previousVelocity[3] = {0, 0, 0};
+
+    for(long i=0; i<chunk.count; i++)
+    {
+        Particle& particle = particles[order[i].second];
+        uint64_t code = order[i].first;
+
+        writeVarint(chunk.data, code - previousCode);
+        previousCode = code;
+
+        uint32_t gridPosition[3] = {compactBits(code), compactBits(code >> 1), compactBits(code >> 2)};
+        for(int axis=0; axis<3; axis++)
+        {
+            float position = (float)(chunk.origin[axis] + (double)gridPosition[axis] * chunk.positionStep);
+            chunk.bounds[axis*2] = std::min(chunk.bounds[axis*2], position);
+            chunk.bounds[axis*2 + 1] = std::max(chunk.bounds[axis*2 + 1], position);
+        }
+
+        float velocity[3] = {particle.vX, particle.vY, particle.vZ};
+        for(int axis=0; axis<3; axis++)
+        {
+            int64_t gridVelocity = std::llround((double)velocity[axis] / chunk.velocityStep);
+            writeVarint(chunk.data, zigzag(gridVelocity - previousVelocity[axis]));
+            previousVelocity[axis] = gridVelocity;
+        }
+
+        if(chunk.integerMasses)
+        {
+            writeValue<uint8_t>(chunk.data, (uint8_t)(particle.mass - MIN_MASS));
+        }
+        else
+        {
+            writeValue<float>(chunk.data, particle.mass);
+        }
+    }
+}
+
+
+static void decodeChunk(SnapshotChunk& chunk, Particle* particles)
+{
+    size_t offset = 0;
+    uint64_t code = 0;
+    int64_t gridVelocity[3] = {0, 0, 0};
+
+    for(long i=0; i<chunk.count; i++)
+    {
+        code += readVarint(chunk.data, offset);
+
+        uint32_t gridPosition[3] = {compactBits(code), compactBits(code >> 1), compactBits(code >> 2)};
+        float position[3], velocity[3];
+        for(int axis=0; axis<3; axis++)
+        {
+            position[axis] = (float)(chunk.origin[axis] + (double)gridPosition[axis] * chunk.positionStep);
+        }
+        for(int axis=0; axis<3; axis++)
+        {
+            gridVelocity[axis] += unzigzag(readVarint(chunk.data, offset));
+            velocity[axis] = (float)((double)gridVelocity[axis] * chunk.velocityStep);
+        }
+
+        float mass = chunk.integerMasses ? (float)(MIN_MASS + readValue<uint8_t>(chunk.data, offset)) : readValue<float>(chunk.data, offset);
+
+        particles[i] = Particle(position[0], position[1], position[2], velocity[0], velocity[1], velocity[2], mass);
+    }
+}
+
+
+Snapshot::Snapshot(float positionError, float velocityError)
+{
+    this->positionError = positionError;
+    this->velocityError = velocityError;
+}
+
+
+// Appends the chunks of the particles order[start, start + count) to ranges, as first indices and counts. The ones
+// spanning more than MAX_GRID_COORDINATE steps on an axis are halved until they fit, so that no chunk has to raise
+// its step above twice the position error.
+static void splitChunk(Particle* particles, std::pair<uint64_t, long>* order, long start, long count, float positionStep, std::vector<std::pair<long, long>>& ranges)
+{
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for(long i = start; i < start + count; i++)
+    {
+        Particle& particle = particles[order[i].second];
+        min[0] = std::min(min[0], particle.x); max[0] = std::max(max[0], particle.x);
+        min[1] = std::min(min[1], particle.y); max[1] = std::max(max[1], particle.y);
+        min[2] = std::min(min[2], particle.z); max[2] = std::max(max[2], particle.z);
+    }
+
+    for(int axis=0; axis<3; axis++)
+    {
+        if(count > 1 && (max[axis] - min[axis]) / (double)positionStep > MAX_GRID_COORDINATE)
+        {
+            splitChunk(particles, order, start, count / 2, positionStep, ranges);
+            splitChunk(particles, order, start + count / 2, count - count / 2, positionStep, ranges);
+            return;
+        }
+    }
+
+    ranges.push_back(std::make_pair(start, count));
+}
+
+
+void Snapshot::encode(Particle* particles, long count)
+{
+    float min[3] = {INFINITY, INFINITY, INFINITY};
+    float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    #pragma omp parallel for reduction(min:min[:3]) reduction(max:max[:3])
+    for(long i=0; i<count; i++)
+    {
+        min[0] = std::min(min[0], particles[i].x); max[0] = std::max(max[0], particles[i].x);
+        min[1] = std::min(min[1], particles[i].y); max[1] = std::max(max[1], particles[i].y);
+        min[2] = std::min(min[2], particles[i].z); max[2] = std::max(max[2], particles[i].z);
+    }
+
+    // Rounding to the nearest grid point is off by at most half a step.
+    float positionStep = 2 * this->positionError;
+
+    // The grid of all the particles only orders them along the curve, so it may be coarser than the chunks' ones.
+    float orderStep = positionStep;
+    for(int axis=0; axis<3; axis++)
+    {
+        orderStep = std::max(orderStep, (float)((max[axis] - min[axis]) / MAX_GRID_COORDINATE));
+    }
+
+    std::vector<std::pair<uint64_t, long>> order(count);
+
+    #pragma omp parallel for
+    for(long i=0; i<count; i++)
+    {
+        float position[3] = {particles[i].x, particles[i].y, particles[i].z};
+        uint32_t gridPosition[3];
+        for(int axis=0; axis<3; axis++)
+        {
+            double coordinate = std::round((position[axis] - min[axis]) / (double)orderStep);
+            gridPosition[axis] = (uint32_t)std::min(std::max(coordinate, 0.0), MAX_GRID_COORDINATE);
+        }
+
+        order[i] = std::make_pair(mortonCode(gridPosition[0], gridPosition[1], gridPosition[2]), i);
+    }
+
+    std::sort(order.begin(), order.end());
+
+    std::vector<std::pair<long, long>> ranges;
+    for(long start = 0; start < count; start += SNAPSHOT_CHUNK_SIZE)
+    {
+        splitChunk(particles, order.data(), start, std::min((long)SNAPSHOT_CHUNK_SIZE, count - start), positionStep, ranges);
+    }
+
+    this->chunks.assign(ranges.size(), SnapshotChunk());
+
+    #pragma omp parallel for schedule(dynamic)
+    for(long c=0; c<ranges.size(); c++)
+    {
+        SnapshotChunk& chunk = this->chunks[c];
+        std::pair<uint64_t, long>* chunkOrder = &order[ranges[c].first];
+        chunk.count = ranges[c].second;
+        chunk.positionStep = positionStep;
+        chunk.velocityStep = 2 * this->velocityError;
+
+        std::fill(chunk.origin, chunk.origin + 3, INFINITY);
+        for(long i=0; i<chunk.count; i++)
+        {
+            Particle& particle = particles[chunkOrder[i].second];
+            chunk.origin[0] = std::min(chunk.origin[0], particle.x);
+            chunk.origin[1] = std::min(chunk.origin[1], particle.y);
+            chunk.origin[2] = std::min(chunk.origin[2], particle.z);
+        }
+
+        // Morton codes on the grid of the chunk, in increasing order for the differences.
+        for(long i=0; i<chunk.count; i++)
+        {
+            Particle& particle = particles[chunkOrder[i].second];
+            float position[3] = {particle.x, particle.y, particle.z};
+            uint32_t gridPosition[3];
+            for(int axis=0; axis<3; axis++)
+            {
+                double coordinate = std::round((position[axis] - chunk.origin[axis]) / (double)positionStep);
+                gridPosition[axis] = (uint32_t)std::min(std::max(coordinate, 0.0), MAX_GRID_COORDINATE);
+            }
+            chunkOrder[i].first = mortonCode(gridPosition[0], gridPosition[1], gridPosition[2]);
+        }
+        std::sort(chunkOrder, chunkOrder + chunk.count);
+
+        encodeChunk(chunk, particles, chunkOrder);
+    }
+
+    this->trackMemory();
+}
+
+
+// Decodes the particles of all the chunks, or only the ones inside the bounds when given.
+void Snapshot::decode(std::vector<Particle>& particles, const float* bounds)
+{
+    std::vector<long> chunkStart(this->chunks.size() + 1, 0);
+    for(long c=0; c<this->chunks.size(); c++)
+    {
+        chunkStart[c + 1] = chunkStart[c] + this->chunks[c].count;
+    }
+
+    std::vector<Particle> decoded(chunkStart.back());
+
+    #pragma omp parallel for schedule(dynamic)
+    for(long c=0; c<this->chunks.size(); c++)
+    {
+        decodeChunk(this->chunks[c], &decoded[chunkStart[c]]);
+    }
+
+    particles.clear();
+    if(bounds == nullptr)
+    {
+        particles.swap(decoded);
+    }
+    else
+    {
+        for(long i=0; i<decoded.size(); i++)
+        {
+            if(contains(bounds, decoded[i]))
+            {
+                particles.push_back(decoded[i]);
+            }
+        }
+    }
+}
+
+
+// Collective write of every process' buffer at its offset, in pieces of at most MAX_WRITE_BYTES since the MPI counts
+// are ints. The processes with fewer pieces write empty ones to match the others.
+static void writeAll(MPI_File file, MPI_Comm communicator, long offset, const std::vector<unsigned char>& buffer)
+{
+    long size = (long)buffer.size();
+    long pieces = (size + MAX_WRITE_BYTES - 1) / MAX_WRITE_BYTES, maxPieces;
+    MPI_Allreduce(&pieces, &maxPieces, 1, MPI_LONG, MPI_MAX, communicator);
+
+    for(long piece=0; piece<maxPieces; piece++)
+    {
+        long start = std::min(piece * MAX_WRITE_BYTES, size);
+        long bytes = std::min(MAX_WRITE_BYTES, size - start);
+        MPI_File_write_at_all(file, offset + start, buffer.data() + start, (int)bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+}
+
+
+// Writes the chunks of all the processes of the communicator to a single file.
+// Every process writes its own part of the chunk index and its own chunks, after those of the lower ranks.
+void Snapshot::write(MPI_Comm communicator, const std::string& path)
+{
+    int rank;
+    MPI_Comm_rank(communicator, &rank);
+
+    // Chunks, particles and bytes of this process, of the lower ranks, and of all the processes.
+    long local[3] = {(long)this->chunks.size(), 0, 0}, before[3] = {0, 0, 0}, total[3];
+    for(SnapshotChunk& chunk : this->chunks)
+    {
+        local[1] += chunk.count;
+        local[2] += chunk.data.size();
+    }
+
+    MPI_Exscan(local, before, 3, MPI_LONG, MPI_SUM, communicator);
+    MPI_Allreduce(local, total, 3, MPI_LONG, MPI_SUM, communicator);
+    if(rank == 0)
+    {
+        std::fill(before, before + 3, 0);
+    }
+
+    long dataStart = HEADER_BYTES + total[0] * INDEX_ENTRY_BYTES;
+
+    std::vector<unsigned char> index, data;
+    data.reserve(local[2]);
+    for(SnapshotChunk& chunk : this->chunks)
+    {
+        writeValue<int64_t>(index, dataStart + before[2] + data.size());
+        writeValue<int64_t>(index, chunk.data.size());
+        writeValue<int64_t>(index, chunk.count);
+        for(int axis=0; axis<3; axis++)
+        {
+            writeValue<float>(index, chunk.origin[axis]);
+        }
+        writeValue<float>(index, chunk.positionStep);
+        writeValue<float>(index, chunk.velocityStep);
+        for(int i=0; i<6; i++)
+        {
+            writeValue<float>(index, chunk.bounds[i]);
+        }
+        writeValue<uint8_t>(index, chunk.integerMasses ? 1 : 0);
+
+        data.insert(data.end(), chunk.data.begin(), chunk.data.end());
+    }
+
+    MPI_File file;
+    MPI_File_open(communicator, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+    MPI_File_set_size(file, 0);
+
+    if(rank == 0)
+    {
+        std::vector<unsigned char> header(MAGIC, MAGIC + 8);
+        writeValue<int64_t>(header, total[0]);
+        writeValue<int64_t>(header, total[1]);
+        MPI_File_write_at(file, 0, header.data(), (int)header.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    writeAll(file, communicator, HEADER_BYTES + before[0] * INDEX_ENTRY_BYTES, index);
+    writeAll(file, communicator, dataStart + before[2], data);
+    MPI_File_close(&file);
+}
+
+
+// Reads the chunks of a snapshot file, or only the ones overlapping the bounds when given.
+// Returns false when the file can't be read.
+bool Snapshot::read(const std::string& path, const float* bounds)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    std::vector<unsigned char> header(HEADER_BYTES);
+
+    if(!file.read((char*)header.data(), HEADER_BYTES) || memcmp(header.data(), MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "Failed to read the snapshot %s\n", path.c_str());
+        return false;
+    }
+
+    size_t offset = 8;
+    long chunkCount = readValue<int64_t>(header, offset);
+
+    std::vector<unsigned char> index(chunkCount * INDEX_ENTRY_BYTES);
+    file.read((char*)index.data(), index.size());
+
+    this->chunks.clear();
+    offset = 0;
+
+    for(long c=0; c<chunkCount; c++)
+    {
+        SnapshotChunk chunk;
+        long dataOffset = readValue<int64_t>(index, offset);
+        long dataBytes = readValue<int64_t>(index, offset);
+        chunk.count = readValue<int64_t>(index, offset);
+        for(int axis=0; axis<3; axis++)
+        {
+            chunk.origin[axis] = readValue<float>(index, offset);
+        }
+        chunk.positionStep = readValue<float>(index, offset);
+        chunk.velocityStep = readValue<float>(index, offset);
+        for(int i=0; i<6; i++)
+        {
+            chunk.bounds[i] = readValue<float>(index, offset);
+        }
+        chunk.integerMasses = readValue<uint8_t>(index, offset) != 0;
+
+        if(bounds != nullptr && !overlaps(bounds, chunk.bounds))
+        {
+            continue;
+        }
+
+        chunk.data.resize(dataBytes);
+        file.seekg(dataOffset);
+        file.read((char*)chunk.data.data(), dataBytes);
+        this->chunks.push_back(std::move(chunk));
+    }
+
+    this->trackMemory();
+
+    if(!file)
+    {
+        fprintf(stderr, "Failed to read the snapshot %s\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+// Size of the chunks once written, with their index entries.
+long Snapshot::bytes()
+{
+    long bytes = 0;
+    for(SnapshotChunk& chunk : this->chunks)
+    {
+        bytes += INDEX_ENTRY_BYTES + chunk.data.size();
+    }
+
+    return bytes;
+}
+
+
+// Reports the change in the capacity of the chunks since the last call.
+void Snapshot::trackMemory()
+{
+    long bytes = 0;
+    for(SnapshotChunk& chunk : this->chunks)
+    {
+        bytes += chunk.data.capacity();
+    }
+
+    MemoryTracker::allocate(SERIALIZATION_BUFFERS, bytes - this->trackedBytes);
+    this->trackedBytes = bytes;
+}
@@ -0,0 +1,65 @@
+#ifndef NBODY_SNAPSHOT_H
+#define NBODY_SNAPSHOT_H
+
+#include "common.h"
+#include "Particle.h"
+#include "MemoryTracker.h"
+#include <mpi.h>
+#include <string>
+#include <vector>
+
+class Particle;
+
+
+// Particles of a snapshot encoded together, which can be decoded without the others.
+struct SnapshotChunk {
+    long count = 0;
+    // Origin and step of the position grid, and step of the velocity grid.
+    // A chunk spans at most 2^21 position steps on every axis, since the Morton codes only keep 21 bits per axis.
+    float origin[3];
+    float positionStep;
+    float velocityStep;
+    // Bounding box of the decoded positions: xMin, xMax, yMin, yMax, zMin, zMax.
+    float bounds[6];
+    // Whether the masses are stored as a byte above MIN_MASS, instead of as floats.
+    bool integerMasses = false;
+    std::vector<unsigned char> data;
+};
+
+
+// Compressed snapshot of the positions, velocities and masses of particles.
+//
+// The particles are sorted along a Morton curve and split into chunks of SNAPSHOT_CHUNK_SIZE, encoded in parallel.
+// The chunks spanning too many grid steps are split further.
+// Positions are quantized to a grid whose step is twice the position error bound, and stored as the difference
+// between the Morton codes of consecutive particles. Velocities are quantized the same way, and stored as the
+// difference from the previous particle. Both are written as variable length integers.
+// Masses take a single byte when they are all integers of [MIN_MASS, MAX_MASS].
+//
+// In a file, a header with the index of all the chunks and their bounding boxes comes before the chunks,
+// so that only the chunks overlapping a region have to be read to get the particles inside it.
+class Snapshot {
+public:
+    // Largest error of a decoded position or velocity component, up to the rounding of floats.
+    float positionError;
+    float velocityError;
+    std::vector<SnapshotChunk> chunks;
+    // Bytes of the chunks reported to the MemoryTracker.
+    long trackedBytes = 0;
+
+    void encode(Particle*, long);
+    void decode(std::vector<Particle>&, const float* = nullptr);
+    void write(MPI_Comm, const std::string&);
+    bool read(const std::string&, const float* = nullptr);
+    long bytes();
+    void trackMemory();
+
+    Snapshot(float = SNAPSHOT_POSITION_ERROR, float = SNAPSHOT_VELOCITY_ERROR);
+    ~Snapshot()
+    {
+        MemoryTracker::release(SERIALIZATION_BUFFERS, this->trackedBytes);
+    };
+};
+
+
+#endif
@@ -0,0 +1,305 @@
+#include "Tuner.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include <omp.h>
+
+namespace mpi = boost::mpi;
+
+
+Tuner::Tuner(float errorBudget) : errorBudget(errorBudget) {}
+
+
+// Applies the stored configuration, or tunes and stores a new one. Returns false when the simulation can't be tuned.
+// Collective over the simulation's processes.
+bool Tuner::run(Simulation& simulation)
+{
+    if(DISTRIBUTED_OWNERSHIP || PERIODIC_BOUNDARIES)
+    {
+        return false;
+    }
+
+    this->maxThreads = omp_get_max_threads();
+    this->loaded = this->load(simulation);
+    if(!this->loaded)
+    {
+        this->tune(simulation);
+        this->save(simulation);
+    }
+
+    this->apply(simulation, this->best);
+    return true;
+}
+
+
+void Tuner::tune(Simulation& simulation)
+{
+    long first, last;
+    simulation.ownedRange(first, last);
+
+    // Samples evenly spaced over this process' range.
+    std::vector<long> samples;
+    long stride = std::max(1L, (last - first) / TUNING_SAMPLES);
+    for(long i = first + stride / 2; i < last; i += stride)
+    {
+        samples.push_back(i);
+    }
+
+    std::vector<float> reference;
+    this->directAccelerations(simulation, samples, reference);
+
+    std::vector<int> leafCapacities = {LEAF_CAPACITY};
+    if(CONCURRENT_TREE_BUILD)
+    {
+        leafCapacities = {1, 2, 4, 8, 16, 32};
+    }
+
+    std::vector<int> threadCounts;
+    for(int threads = 1; threads < this->maxThreads; threads *= 2)
+    {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(this->maxThreads);
+
+    std::vector<float> omegas = {1.0f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f, 0.4f, 0.3f, 0.2f};
+
+    simulation.computeRootBounds();
+    this->stepTime = 0;
+    this->forceError = 0;
+
+    for(int leafCapacity : leafCapacities)
+    {
+        TuningConfiguration configuration;
+        configuration.leafCapacity = leafCapacity;
+        configuration.threadCount = this->maxThreads;
+        this->apply(simulation, configuration);
+
+        double phaseStart = MPI_Wtime();
+        simulation.buildTree(phaseStart);
+
+        // The largest angle within the budget, falling back to the smallest one.
+        double error = 0;
+        for(float omega : omegas)
+        {
+            simulation.tree.omega = omega;
+            configuration.omega = omega;
+            error = this->treeError(simulation, samples, reference);
+
+            if(error <= this->errorBudget)
+            {
+                break;
+            }
+        }
+
+        for(int threads : threadCounts)
+        {
+            configuration.threadCount = threads;
+            this->apply(simulation, configuration);
+
+            double time = this->trialTime(simulation);
+            for(int trial = 1; trial < TUNING_TRIALS; trial++)
+            {
+                time = std::min(time, this->trialTime(simulation));
+            }
+
+            // Configurations over the budget only win against other ones over it.
+            bool withinBudget = error <= this->errorBudget, bestWithinBudget = this->forceError <= this->errorBudget;
+            if(this->stepTime == 0 || (withinBudget && !bestWithinBudget) || (withinBudget == bestWithinBudget && time < this->stepTime))
+            {
+                this->best = configuration;
+                this->stepTime = time;
+                this->forceError = error;
+            }
+        }
+    }
+}
+
+
+// Velocity changes of the samples over a timestep from all the particles, without changing the particles.
+void Tuner::directAccelerations(Simulation& simulation, std::vector<long>& samples, std::vector<float>& reference)
+{
+    reference.resize(3 * samples.size());
+    long particleCount = simulation.particles.size();
+
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t k=0; k<samples.size(); k++)
+    {
+        Particle particle = simulation.particles[samples[k]];
+        particle.vX = particle.vY = particle.vZ = 0;
+
+        for(long j=0; j<particleCount; j++)
+        {
+            if(j != samples[k])
+            {
+                particle.forcePush(&simulation.particles[j], TIMESTEP);
+            }
+        }
+
+        reference[3*k] = particle.vX;
+        reference[3*k + 1] = particle.vY;
+        reference[3*k + 2] = particle.vZ;
+    }
+}
+
+
+// RMS relative error of the samples' tree walks over all the processes, with the current tree and opening angle.
+double Tuner::treeError(Simulation& simulation, std::vector<long>& samples, std::vector<float>& reference)
+{
+    double errors[2] = {0, (double)samples.size()}, totalErrors[2];
+
+    for(size_t k=0; k<samples.size(); k++)
+    {
+        Particle& particle = simulation.particles[samples[k]];
+        float vX = particle.vX, vY = particle.vY, vZ = particle.vZ;
+        double potential = 0;
+
+        long cellInteractions = 0, particleInteractions = 0;
+
+        simulation.walkTree(samples[k], potential, false, cellInteractions, particleInteractions);
+
+        double dX = (particle.vX - vX) - reference[3*k];
+        double dY = (particle.vY - vY) - reference[3*k + 1];
+        double dZ = (particle.vZ - vZ) - reference[3*k + 2];
+        double norm = (double)reference[3*k] * reference[3*k] + (double)reference[3*k + 1] * reference[3*k + 1] + (double)reference[3*k + 2] * reference[3*k + 2];
+
+        if(norm > 0)
+        {
+            errors[0] += (dX*dX + dY*dY + dZ*dZ) / norm;
+        }
+
+        particle.vX = vX;
+        particle.vY = vY;
+        particle.vZ = vZ;
+    }
+
+    mpi::all_reduce(simulation.world, errors, 2, totalErrors, std::plus<double>());
+    return totalErrors[1] > 0 ? std::sqrt(totalErrors[0] / totalErrors[1]) : 0;
+}
+
+
+// Time of building the tree and walking it for this process' particles, the slowest process', leaving the particles as
+// they were.
+double Tuner::trialTime(Simulation& simulation)
+{
+    long first, last;
+    simulation.ownedRange(first, last);
+    std::vector<Particle> saved(&simulation.particles[first], &simulation.particles[first] + (last - first));
+
+    simulation.world.barrier();
+    double start = MPI_Wtime();
+    double phaseStart = start;
+
+    simulation.buildTree(phaseStart);
+    long cellInteractions = 0, particleInteractions = 0;
+
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:cellInteractions,particleInteractions)
+    for(long i = first; i < last; i++)
+    {
+        double potential = 0;
+        simulation.walkTree(i, potential, false, cellInteractions, particleInteractions);
+    }
+
+    double time;
+    mpi::all_reduce(simulation.world, MPI_Wtime() - start, time, mpi::maximum<double>());
+
+    std::copy(saved.begin(), saved.end(), &simulation.particles[first]);
+    simulation.particles.synchronize();
+    return time;
+}
+
+
+void Tuner::apply(Simulation& simulation, TuningConfiguration& configuration)
+{
+    simulation.tree.omega = configuration.omega;
+    simulation.branchTree.leafCapacity = configuration.leafCapacity;
+    simulation.threadCount = configuration.threadCount;
+    if(configuration.threadCount > 0)
+    {
+        omp_set_num_threads(configuration.threadCount);
+    }
+
+    // The cached lists belong to the tree built before.
+    simulation.interactionCache.valid = false;
+}
+
+
+// Key of the runs sharing a configuration: the host of the main process, the processes, the particles, the budget, the
+// opening criterion and the most threads available.
+static std::string tuningKey(Simulation& simulation, float errorBudget, int maxThreads)
+{
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+
+    std::ostringstream key;
+    key<<host<<" "<<simulation.world.size()<<" "<<simulation.particles.size()<<" "<<errorBudget<<" "<<(int)OPENING_CRITERION<<" "<<maxThreads;
+    return key.str();
+}
+
+
+// Reads the configuration of this kind of run from TUNING_FILE on the main process, the last one stored winning.
+bool Tuner::load(Simulation& simulation)
+{
+    bool found = false;
+
+    if(simulation.world.rank() == 0)
+    {
+        std::string key = tuningKey(simulation, this->errorBudget, this->maxThreads) + " ";
+        std::ifstream file(TUNING_FILE);
+        std::string line;
+
+        // Lines hold the key, then the omega, leaf capacity, thread count, force error and step time.
+        while(std::getline(file, line))
+        {
+            if(line.compare(0, key.size(), key) != 0)
+            {
+                continue;
+            }
+
+            std::istringstream fields(line.substr(key.size()));
+            TuningConfiguration configuration;
+            double error, time;
+
+            if(fields>>configuration.omega>>configuration.leafCapacity>>configuration.threadCount>>error>>time)
+            {
+                this->best = configuration;
+                this->forceError = error;
+                this->stepTime = time;
+                found = true;
+            }
+        }
+    }
+
+    float values[5] = {this->best.omega, (float)this->best.leafCapacity, (float)this->best.threadCount, (float)this->forceError, (float)this->stepTime};
+    mpi::broadcast(simulation.world, found, 0);
+    mpi::broadcast(simulation.world, values, 5, 0);
+
+    this->best.omega = values[0];
+    this->best.leafCapacity = (int)values[1];
+    this->best.threadCount = (int)values[2];
+    this->forceError = values[3];
+    this->stepTime = values[4];
+    return found;
+}
+
+
+void Tuner::save(Simulation& simulation)
+{
+    if(simulation.world.rank() != 0)
+    {
+        return;
+    }
+
+    std::ofstream file(TUNING_FILE, std::ios::app);
+    if(!file)
+    {
+        fprintf(stderr, "Failed to write the tuning to %s\n", TUNING_FILE);
+        return;
+    }
+
+    file<<tuningKey(simulation, this->errorBudget, this->maxThreads)<<" "<<this->best.omega<<" "<<this->best.leafCapacity<<" "<<this->best.threadCount;
+    file<<" "<<this->forceError<<" "<<this->stepTime<<"\n";
+}
@@ -0,0 +1,56 @@
+#ifndef NBODY_TUNER_H
+#define NBODY_TUNER_H
+
+#include "common.h"
+#include "Simulation.h"
+#include <vector>
+
+class Simulation;
+
+
+// Parameters chosen by the tuner.
+struct TuningConfiguration {
+    float omega = OMEGA;
+    int leafCapacity = LEAF_CAPACITY;
+    int threadCount = 0;
+};
+
+
+// Picks the fastest opening angle, leaf capacity and thread count which keep the forces within the error budget.
+//
+// The error is the RMS of the relative acceleration errors of TUNING_SAMPLES particles of every process, against a
+// direct sum over all the particles. For every leaf capacity, the largest opening angle within the budget is searched,
+// since larger angles only make the walk cheaper, and then every thread count is timed on a step without moving
+// the particles, which builds the tree and walks it in parallel. The choice is stored in TUNING_FILE and reused by later
+// runs of the same shape, opening criterion and number of available threads on the same host.
+// Needs every process to hold all the particles, and the reference has no periodic images, so it does nothing with
+// DISTRIBUTED_OWNERSHIP or PERIODIC_BOUNDARIES.
+// The leaf capacity is only tuned with CONCURRENT_TREE_BUILD, which is the build it applies to.
+class Tuner {
+public:
+    float errorBudget;
+    TuningConfiguration best;
+    // Error and step time of the best configuration, and whether it was read from TUNING_FILE.
+    double forceError = 0;
+    double stepTime = 0;
+    bool loaded = false;
+
+    bool run(Simulation&);
+
+    Tuner(float = TUNING_ERROR_BUDGET);
+
+private:
+    // Threads available before the tuning changes the count.
+    int maxThreads = 0;
+
+    void tune(Simulation&);
+    bool load(Simulation&);
+    void save(Simulation&);
+    void apply(Simulation&, TuningConfiguration&);
+    void directAccelerations(Simulation&, std::vector<long>&, std::vector<float>&);
+    double treeError(Simulation&, std::vector<long>&, std::vector<float>&);
+    double trialTime(Simulation&);
+};
+
+
+#endif
@@ -0,0 +1,229 @@
+#include <mpi.h>
+#include <iostream>
+#include <boost/mpi.hpp>
+#include <boost/program_options.hpp>
+
+#include "common.h"
+#include "Simulation.h"
+#include "Snapshot.h"
+#include "Tuner.h"
+#include <vector>
+
+namespace mpi = boost::mpi;
+namespace po = boost::program_options;
+
+
+// Encodes and decodes a snapshot of the particles after the warmup steps, and prints a single CSV line:
+// processes, particles, raw and compressed bytes, compression ratio, and encode and decode GB/s of the raw particles,
+// with every process working on its own range.
+void benchmarkSnapshot(mpi::communicator& world, Simulation& simulation, long particleCount, long repeats, bool header)
+{
+    long first, last;
+    simulation.ownedRange(first, last);
+
+    Snapshot snapshot;
+    std::vector<Particle> decoded;
+    double times[2] = {0, 0}, maxTimes[2];
+    long bytes[2] = {(last - first) * 7 * (long)sizeof(float), 0}, totalBytes[2];
+
+    for(long i=0; i<repeats; i++)
+    {
+        world.barrier();
+        double start = MPI_Wtime();
+        snapshot.encode(&simulation.particles[first], last - first);
+        times[0] += MPI_Wtime() - start;
+
+        start = MPI_Wtime();
+        snapshot.decode(decoded);
+        times[1] += MPI_Wtime() - start;
+    }
+    bytes[1] = snapshot.bytes();
+
+    mpi::reduce(world, times, 2, maxTimes, mpi::maximum<double>(), 0);
+    mpi::reduce(world, bytes, 2, totalBytes, std::plus<long>(), 0);
+
+    if(world.rank() == 0)
+    {
+        if(header)
+        {
+            std::cout<<"processes,particles,raw bytes,compressed bytes,ratio,encode GB/s,decode GB/s\n";
+        }
+
+        std::cout<<world.size()<<","<<particleCount<<","<<totalBytes[0]<<","<<totalBytes[1];
+        std::cout<<","<<(double)totalBytes[0] / totalBytes[1];
+        std::cout<<","<<repeats * totalBytes[0] / maxTimes[0] / 1e9<<","<<repeats * totalBytes[0] / maxTimes[1] / 1e9<<"\n";
+    }
+}
+
+
+// Prints one CSV line per phase: the hardware counts of the timed steps summed over the processes, then the counts per
+// particle and step and per interaction, and the instructions per cycle.
+void printCounters(mpi::communicator& world, double counts[PHASE_COUNT][HARDWARE_COUNTER_COUNT], long interactions, long particleCount, long steps, bool header)
+{
+    double totalCounts[PHASE_COUNT][HARDWARE_COUNTER_COUNT];
+    long totalInteractions;
+    mpi::reduce(world, &counts[0][0], PHASE_COUNT * HARDWARE_COUNTER_COUNT, &totalCounts[0][0], std::plus<double>(), 0);
+    mpi::reduce(world, interactions, totalInteractions, std::plus<long>(), 0);
+
+    if(world.rank() != 0)
+    {
+        return;
+    }
+
+    if(header)
+    {
+        std::cout<<"processes,particles,steps,phase";
+        for(const char* rate : {"", " per particle", " per interaction"})
+        {
+            for(int k=0; k<HARDWARE_COUNTER_COUNT; k++)
+            {
+                std::cout<<","<<PerformanceCounters::name((HardwareCounter)k)<<rate;
+            }
+        }
+        std::cout<<",instructions per cycle\n";
+    }
+
+    for(int j=0; j<PHASE_COUNT; j++)
+    {
+        std::cout<<world.size()<<","<<particleCount<<","<<steps<<","<<Simulation::phaseName((SimulationPhase)j);
+        for(double divisor : {1.0, (double)particleCount * steps, (double)totalInteractions})
+        {
+            for(int k=0; k<HARDWARE_COUNTER_COUNT; k++)
+            {
+                std::cout<<","<<(divisor > 0 ? totalCounts[j][k] / divisor : 0);
+            }
+        }
+        std::cout<<","<<(totalCounts[j][CYCLES] > 0 ? totalCounts[j][INSTRUCTIONS] / totalCounts[j][CYCLES] : 0)<<"\n";
+    }
+}
+
+
+// Headless driver, timing a fixed number of steps.
+// Prints a single CSV line: processes, particles, steps, then the total and per phase seconds of all the steps,
+// each the maximum over processes.
+int main(int argc, char** argv)
+{
+    mpi::environment env;
+    mpi::communicator world;
+
+    long particleCount, steps, warmupSteps;
+    unsigned long seed;
+    bool header, snapshot, counters;
+    float errorBudget;
+
+    po::options_description options("Options");
+    options.add_options()
+            ("help", "print the options")
+            ("particles", po::value<long>(&particleCount)->default_value(PARTICLE_COUNT), "number of particles")
+            ("steps", po::value<long>(&steps)->default_value(20), "number of timed steps")
+            ("warmup", po::value<long>(&warmupSteps)->default_value(2), "number of steps run before the timed ones")
+            ("seed", po::value<unsigned long>(&seed)->default_value(SEED), "seed of the initial conditions")
+            ("header", po::bool_switch(&header), "print the CSV header first")
+            ("snapshot", po::bool_switch(&snapshot), "time snapshot encoding and decoding instead of the steps, repeated --steps times")
+            ("tune", po::value<float>(&errorBudget)->default_value(AUTO_TUNING ? TUNING_ERROR_BUDGET : 0), "auto-tune the parameters within this force error before the warmup, 0 to keep the defaults")
+            ("counters", po::bool_switch(&counters), "print the hardware counts of every phase instead of the times, when the counters are available");
+
+    po::variables_map arguments;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, options), arguments);
+        po::notify(arguments);
+    }
+    catch(po::error& error)
+    {
+        if(world.rank() == 0)
+        {
+            std::cerr<<error.what()<<"\n"<<"Usage: "<<argv[0]<<" [options]\n"<<options;
+        }
+        return 1;
+    }
+
+    if(arguments.count("help"))
+    {
+        if(world.rank() == 0)
+        {
+            std::cout<<"Usage: "<<argv[0]<<" [options]\n"<<options;
+        }
+        return 0;
+    }
+
+    double times[PHASE_COUNT + 1] = {0}, maxTimes[PHASE_COUNT + 1];
+    double counts[PHASE_COUNT][HARDWARE_COUNTER_COUNT] = {};
+    long interactions = 0;
+
+    {
+        Simulation simulation(world, particleCount, seed);
+        simulation.countHardwareEvents = simulation.countHardwareEvents || counters;
+
+        // The choice goes to stderr, so that the output stays a CSV.
+        Tuner tuner(errorBudget);
+        if(errorBudget > 0 && tuner.run(simulation) && world.rank() == 0)
+        {
+            std::cerr<<"omega "<<tuner.best.omega<<", leaf capacity "<<tuner.best.leafCapacity<<", "<<tuner.best.threadCount<<" threads";
+            std::cerr<<", force error "<<tuner.forceError<<", "<<tuner.stepTime<<" s per step\n";
+        }
+        simulation.step(warmupSteps);
+
+        if(snapshot)
+        {
+            benchmarkSnapshot(world, simulation, particleCount, steps, header);
+            return 0;
+        }
+
+        world.barrier();
+        double start = MPI_Wtime();
+
+        // Step one at a time, to add up the phases of every step.
+        for(long i=0; i<steps; i++)
+        {
+            simulation.step(1);
+
+            for(int j=0; j<PHASE_COUNT; j++)
+            {
+                times[j + 1] += simulation.phaseTimes[j];
+
+                for(int k=0; k<HARDWARE_COUNTER_COUNT; k++)
+                {
+                    counts[j][k] += simulation.phaseCounters[j][k];
+                }
+            }
+            interactions += simulation.cellInteractions + simulation.particleInteractions;
+        }
+
+        times[0] = MPI_Wtime() - start;
+
+        // Without counters on every process, print the times instead.
+        bool available;
+        mpi::all_reduce(world, simulation.counters.available, available, std::logical_and<bool>());
+
+        if(counters && available)
+        {
+            printCounters(world, counts, interactions, particleCount, steps, header);
+            return 0;
+        }
+    }
+
+    mpi::reduce(world, times, PHASE_COUNT + 1, maxTimes, mpi::maximum<double>(), 0);
+
+    if(world.rank() == 0)
+    {
+        if(header)
+        {
+            std::cout<<"processes,particles,steps,total";
+            for(int j=0; j<PHASE_COUNT; j++)
+            {
+                std::cout<<","<<Simulation::phaseName((SimulationPhase)j);
+            }
+            std::cout<<"\n";
+        }
+
+        std::cout<<world.size()<<","<<particleCount<<","<<steps;
+        for(int j=0; j<PHASE_COUNT + 1; j++)
+        {
+            std::cout<<","<<maxTimes[j];
+        }
+        std::cout<<"\n";
+    }
+
+    return 0;
+}
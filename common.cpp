@@ -1,11 +1,45 @@
 #include "common.h"
-#include <cstdlib>
+#include <cmath>
 
 const int PARTICLE_COUNT = 500;
 const float TIMESTEP = 1;
 const int SOFTENING_LENGTH = 10;
 
 const float OMEGA = 0.5;
+const OpeningCriterion OPENING_CRITERION = GEOMETRIC;
+const float ACCELERATION_TOLERANCE = 0.005;
+// Used to avoid infinite forces.
+const float FORCE_SOFTENING = 3e4;
+// When set, the softening of every particle follows the distance to its SOFTENING_NEIGHBORS-th nearest neighbor.
+const bool ADAPTIVE_SOFTENING = false;
+const int SOFTENING_NEIGHBORS = 16;
+const int LEAF_CAPACITY = 8;
+// Leaves smaller than this are never split, so that coincident particles can't cause infinite recursion.
+const float MIN_CELL_SIZE = 1e-6;
+// Build the branches with all the threads of a process, instead of inserting the particles in Cell objects one by one.
+const bool CONCURRENT_TREE_BUILD = true;
+// When set, interaction lists are kept for up to INTERACTION_LIST_MAX_AGE steps, and the tree is only rebuilt when
+// a particle moved more than half of INTERACTION_LIST_MARGIN since the lists were built.
+const bool INTERACTION_LIST_CACHING = false;
+const float INTERACTION_LIST_MARGIN = 0.1;
+const int INTERACTION_LIST_MAX_AGE = 8;
+// When set, the root cell is the smallest cube holding all the particles at the start of every step, instead of the
+// coordinate range, so that no particle escapes the tree and collapsed systems don't waste levels.
+const bool ADAPTIVE_ROOT_BOUNDS = true;
+// When set, the coordinate range is a periodic box: particles leaving it come back on the other side, and every
+// interaction is with the nearest image of its source, plus the Ewald correction for the other images, interpolated
+// from a table of EWALD_TABLE_SIZE + 1 points per axis over half the box.
+const bool PERIODIC_BOUNDARIES = false;
+const int EWALD_TABLE_SIZE = 32;
+// Largest relative error of the interpolated corrections, checked against the direct sum at EWALD_CHECK_SAMPLES points.
+const float EWALD_TABLE_TOLERANCE = 0.01;
+const int EWALD_CHECK_SAMPLES = 256;
+// When set, every process only keeps the particles of its own domain, a range of Morton keys, and the parts of the
+// other domains' trees it needs, instead of all the particles. Interaction lists aren't cached in that mode.
+const bool DISTRIBUTED_OWNERSHIP = false;
+// Keys sampled by every process to balance the domains.
+const int DOMAIN_SAMPLES = 64;
+const bool QUANTIZE_TREE_CENTERS = true;
 const float PI = 3.141592;
 const float G = 6.67384e-11 * 1e12;
 const int MIN_MASS = 25;
@@ -14,11 +48,106 @@ const int MAX_MASS = 50;
 const float COORDINATE_MIN_VALUE = -1.4;
 const float COORDINATE_MAX_VALUE = 1.4;
 
+const unsigned long SEED = 100;
+// Energy and momentum are reported every DIAGNOSTICS_INTERVAL steps.
+const int DIAGNOSTICS_INTERVAL = 10;
+// Pairs of particles closer than this are counted with the diagnostics.
+const float CLOSE_PAIR_DISTANCE = 0.01;
+// A compressed snapshot of the particles is written every SNAPSHOT_INTERVAL steps, or never when 0.
+const int SNAPSHOT_INTERVAL = 0;
+// Largest errors of the positions and velocities stored in the snapshots.
+const float SNAPSHOT_POSITION_ERROR = 1e-5;
+const float SNAPSHOT_VELOCITY_ERROR = 1e-6;
+const int SNAPSHOT_CHUNK_SIZE = 4096;
+// The projected density map and the radial profile are computed and written every ANALYSIS_INTERVAL steps,
+// or never when 0.
+const int ANALYSIS_INTERVAL = 0;
+const int ANALYSIS_GRID_SIZE = 256;
+const int ANALYSIS_RADIAL_BINS = 64;
+// Count cycles, instructions, cache misses and branch misses of every phase with the hardware counters, when the
+// system allows it.
+const bool PERFORMANCE_COUNTERS = false;
+// Before the first step, pick the opening angle, leaf capacity and thread count of the fastest trial whose forces stay
+// within TUNING_ERROR_BUDGET, the RMS of the relative acceleration errors of TUNING_SAMPLES particles per process
+// against a direct sum. Every trial is timed TUNING_TRIALS times. The choices are kept in TUNING_FILE, and reused by
+// the later runs on the same host with the same processes, particles and budget.
+const bool AUTO_TUNING = false;
+const float TUNING_ERROR_BUDGET = 0.005;
+const int TUNING_SAMPLES = 64;
+const int TUNING_TRIALS = 2;
+const char* const TUNING_FILE = "tuning.txt";
+
 const float WINDOW_WIDTH = 800;
 const float WINDOW_HEIGHT = 600;
+// When set, the tree cells are drawn instead of the particles, each as a single point at its center of mass,
+// sized by its mass. A cell is opened only while it would cover more than LOD_PIXEL_SIZE pixels on screen.
+const bool LOD_RENDERING = false;
+const float LOD_PIXEL_SIZE = 4;
+
+// Mixes the bits of a 64 bit value (the SplitMix64 finalizer).
+static uint64_t mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Generates a random float in (0, 1) using an uniform distribution.
+// The value only depends on the seed and the counter, so that any process or thread can draw any value of the stream.
+float randUniform(unsigned long seed, unsigned long counter)
+{
+    uint64_t z = mix(mix(seed + 0x9E3779B97F4A7C15ULL) ^ (counter * 0x9E3779B97F4A7C15ULL));
+
+    // Keep 23 bits, so that the half step offset which keeps the value away from 0 and 1 is still exact.
+    return ((float)(z >> 41) + 0.5f) / (float)(1 << 23);
+}
+
+
+// Spreads the 21 low bits of the value to every third bit.
+static uint64_t spreadBits(uint64_t value)
+{
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffffULL;
+    value = (value | value << 16) & 0x1f0000ff0000ffULL;
+    value = (value | value << 8) & 0x100f00f00f00f00fULL;
+    value = (value | value << 4) & 0x10c30c30c30c30c3ULL;
+    value = (value | value << 2) & 0x1249249249249249ULL;
+    return value;
+}
+
+// Interleaves the 21 low bits of the coordinates into a key along a Morton curve, with x in the lowest bit,
+// matching the octant order of Cell::expandChildren.
+uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return spreadBits(x) | spreadBits(y) << 1 | spreadBits(z) << 2;
+}
+
+
+// Offset between two coordinates of the periodic box, wrapped to the nearest image: within half the box.
+float nearestImage(float delta)
+{
+    const float size = COORDINATE_MAX_VALUE - COORDINATE_MIN_VALUE;
+    return delta - size * std::round(delta / size);
+}
+
+
+// Whether the offsets of an interval of the given length around delta reach half the periodic box, where their
+// nearest images change sides.
+bool crossesHalfBox(float delta, float length)
+{
+    return std::fabs(nearestImage(delta)) + length / 2 >= (COORDINATE_MAX_VALUE - COORDINATE_MIN_VALUE) / 2;
+}
+
 
-// Generates a random float using an uniform distribution.
-float randUniform()
+// Coordinate brought back into the periodic box. Cells hold their upper faces and not their lower ones, so the
+// coordinate ends up in (COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE].
+float wrapCoordinate(float coordinate)
 {
-    return (float)rand() / (float)RAND_MAX ;
+    const float size = COORDINATE_MAX_VALUE - COORDINATE_MIN_VALUE;
+    float offset = std::fmod(coordinate - COORDINATE_MIN_VALUE, size);
+    if(offset <= 0)
+    {
+        offset += size;
+    }
+    return COORDINATE_MIN_VALUE + offset;
 }
@@ -1,12 +1,44 @@
 #ifndef NBODY_COMMON_H
 #define NBODY_COMMON_H
 
+#include <cstdint>
+
+// Tests deciding whether a cell is far enough from a particle to be used as a cluster.
+enum OpeningCriterion {
+    // Barnes-Hut: the cell size over the distance to its center of gravity is below OMEGA.
+    GEOMETRIC,
+    // Barnes-Hut, with the distance reduced by the offset of the center of gravity from the cell center.
+    CENTER_OFFSET,
+    // Salmon-Warren style bound on the acceleration error, relative to the previous step's acceleration.
+    RELATIVE_ACCELERATION,
+    // Salmon-Warren style bound on the absolute acceleration error.
+    ABSOLUTE_ACCELERATION
+};
 
 extern const int PARTICLE_COUNT;
 extern const float TIMESTEP;
 extern const int SOFTENING_LENGTH;
 
 extern const float OMEGA;
+extern const OpeningCriterion OPENING_CRITERION;
+extern const float ACCELERATION_TOLERANCE;
+extern const float FORCE_SOFTENING;
+extern const bool ADAPTIVE_SOFTENING;
+extern const int SOFTENING_NEIGHBORS;
+extern const int LEAF_CAPACITY;
+extern const float MIN_CELL_SIZE;
+extern const bool CONCURRENT_TREE_BUILD;
+extern const bool INTERACTION_LIST_CACHING;
+extern const float INTERACTION_LIST_MARGIN;
+extern const int INTERACTION_LIST_MAX_AGE;
+extern const bool ADAPTIVE_ROOT_BOUNDS;
+extern const bool PERIODIC_BOUNDARIES;
+extern const int EWALD_TABLE_SIZE;
+extern const float EWALD_TABLE_TOLERANCE;
+extern const int EWALD_CHECK_SAMPLES;
+extern const bool DISTRIBUTED_OWNERSHIP;
+extern const int DOMAIN_SAMPLES;
+extern const bool QUANTIZE_TREE_CENTERS;
 extern const float PI;
 extern const float G;
 extern const int MIN_MASS;
@@ -15,9 +47,32 @@ extern const int MAX_MASS;
 extern const float COORDINATE_MIN_VALUE;
 extern const float COORDINATE_MAX_VALUE;
 
+extern const unsigned long SEED;
+extern const int DIAGNOSTICS_INTERVAL;
+extern const float CLOSE_PAIR_DISTANCE;
+extern const int SNAPSHOT_INTERVAL;
+extern const float SNAPSHOT_POSITION_ERROR;
+extern const float SNAPSHOT_VELOCITY_ERROR;
+extern const int SNAPSHOT_CHUNK_SIZE;
+extern const int ANALYSIS_INTERVAL;
+extern const int ANALYSIS_GRID_SIZE;
+extern const int ANALYSIS_RADIAL_BINS;
+extern const bool PERFORMANCE_COUNTERS;
+extern const bool AUTO_TUNING;
+extern const float TUNING_ERROR_BUDGET;
+extern const int TUNING_SAMPLES;
+extern const int TUNING_TRIALS;
+extern const char* const TUNING_FILE;
+
 extern const float WINDOW_WIDTH;
 extern const float WINDOW_HEIGHT;
+extern const bool LOD_RENDERING;
+extern const float LOD_PIXEL_SIZE;
 
-float randUniform();
+float randUniform(unsigned long, unsigned long);
+uint64_t mortonCode(uint32_t, uint32_t, uint32_t);
+float nearestImage(float);
+bool crossesHalfBox(float, float);
+float wrapCoordinate(float);
 
 #endif
\ No newline at end of file
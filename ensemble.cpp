@@ -0,0 +1,178 @@
+#include <mpi.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/mpi.hpp>
+#include <boost/program_options.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include "common.h"
+#include "Simulation.h"
+
+namespace mpi = boost::mpi;
+namespace po = boost::program_options;
+
+
+// Fields of a run's result, as sent to the main process.
+enum RunField {
+    RUN_INDEX, RUN_GROUP, RUN_PROCESSES, RUN_PARTICLES, RUN_OMEGA, RUN_SOFTENING_LENGTH, RUN_SEED,
+    RUN_SECONDS, RUN_ENERGY_DRIFT, RUN_FIELD_COUNT
+};
+
+
+// Total energy of the group's particles, from the diagnostics of the last step.
+double groupEnergy(mpi::communicator& group, Simulation& simulation)
+{
+    double diagnostics[Simulation::DIAGNOSTICS_COUNT];
+    mpi::all_reduce(group, simulation.diagnostics, Simulation::DIAGNOSTICS_COUNT, diagnostics, std::plus<double>());
+    return diagnostics[0] + diagnostics[1];
+}
+
+
+// Runs a parameter sweep as independent simulations, one per group of processes.
+// The processes are split into --groups sub-communicators, and the runs of the sweep, every combination of the
+// given particle counts, opening angles, scale lengths and seeds, are dealt to the groups in turn.
+// Prints one CSV line per run, then the throughput of the whole ensemble.
+int main(int argc, char** argv)
+{
+    mpi::environment env;
+    mpi::communicator world;
+
+    int groupCount;
+    long steps;
+    std::vector<long> particleCounts;
+    std::vector<float> omegas;
+    std::vector<int> softeningLengths;
+    std::vector<unsigned long> seeds;
+
+    po::options_description options("Options");
+    options.add_options()
+            ("help", "print the options")
+            ("groups", po::value<int>(&groupCount)->default_value(1), "number of groups of processes running simulations side by side")
+            ("steps", po::value<long>(&steps)->default_value(20), "number of steps of every run")
+            ("particles", po::value<std::vector<long>>(&particleCounts)->multitoken()->default_value({PARTICLE_COUNT}, std::to_string(PARTICLE_COUNT)), "particle counts of the sweep")
+            ("omega", po::value<std::vector<float>>(&omegas)->multitoken()->default_value({OMEGA}, std::to_string(OMEGA)), "opening angles of the sweep")
+            ("softening-length", po::value<std::vector<int>>(&softeningLengths)->multitoken()->default_value({SOFTENING_LENGTH}, std::to_string(SOFTENING_LENGTH)), "Plummer scale lengths of the sweep")
+            ("seed", po::value<std::vector<unsigned long>>(&seeds)->multitoken()->default_value({SEED}, std::to_string(SEED)), "seeds of the sweep");
+
+    po::variables_map arguments;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, options), arguments);
+        po::notify(arguments);
+    }
+    catch(po::error& error)
+    {
+        if(world.rank() == 0)
+        {
+            std::cerr<<error.what()<<"\n"<<"Usage: "<<argv[0]<<" [options]\n"<<options;
+        }
+        return 1;
+    }
+
+    if(arguments.count("help"))
+    {
+        if(world.rank() == 0)
+        {
+            std::cout<<"Usage: "<<argv[0]<<" [options]\n"<<options;
+        }
+        return 0;
+    }
+
+    groupCount = std::max(1, std::min(groupCount, world.size()));
+
+    // Consecutive ranks form a group, so that groups keep to as few nodes as possible.
+    int groupIndex = (int)((long)world.rank() * groupCount / world.size());
+    mpi::communicator group = world.split(groupIndex);
+
+    long runCount = (long)(particleCounts.size() * omegas.size() * softeningLengths.size() * seeds.size());
+    std::vector<double> results;
+
+    world.barrier();
+    double start = MPI_Wtime();
+
+    for(long run = groupIndex; run < runCount; run += groupCount)
+    {
+        long k = run;
+        unsigned long seed = seeds[k % seeds.size()]; k /= seeds.size();
+        int softeningLength = softeningLengths[k % softeningLengths.size()]; k /= softeningLengths.size();
+        float omega = omegas[k % omegas.size()]; k /= omegas.size();
+        long particleCount = particleCounts[k];
+
+        double runStart = MPI_Wtime();
+        double initialEnergy = 0, energy = 0;
+
+        {
+            Simulation simulation(group, particleCount, seed, omega, softeningLength);
+
+            for(long i=0; i<steps; i++)
+            {
+                simulation.step(1);
+
+                if(simulation.diagnosticsComputed)
+                {
+                    energy = groupEnergy(group, simulation);
+                    if(i == 0)
+                    {
+                        initialEnergy = energy;
+                    }
+                }
+            }
+        }
+
+        double runTime;
+        mpi::all_reduce(group, MPI_Wtime() - runStart, runTime, mpi::maximum<double>());
+
+        double result[RUN_FIELD_COUNT];
+        result[RUN_INDEX] = run;
+        result[RUN_GROUP] = groupIndex;
+        result[RUN_PROCESSES] = group.size();
+        result[RUN_PARTICLES] = particleCount;
+        result[RUN_OMEGA] = omega;
+        result[RUN_SOFTENING_LENGTH] = softeningLength;
+        result[RUN_SEED] = seed;
+        result[RUN_SECONDS] = runTime;
+        result[RUN_ENERGY_DRIFT] = initialEnergy != 0 ? (energy - initialEnergy) / std::abs(initialEnergy) : 0;
+
+        if(group.rank() == 0)
+        {
+            results.insert(results.end(), result, result + RUN_FIELD_COUNT);
+        }
+    }
+
+    double totalTime;
+    mpi::reduce(world, MPI_Wtime() - start, totalTime, mpi::maximum<double>(), 0);
+
+    // Aggregate the results of all the groups on the main process.
+    std::vector<std::vector<double>> groupResults;
+    mpi::gather(world, results, groupResults, 0);
+
+    if(world.rank() == 0)
+    {
+        std::vector<std::vector<double>> runs(runCount);
+        for(std::vector<double>& processResults : groupResults)
+        {
+            for(size_t i=0; i<processResults.size(); i+=RUN_FIELD_COUNT)
+            {
+                runs[(long)processResults[i + RUN_INDEX]].assign(&processResults[i], &processResults[i] + RUN_FIELD_COUNT);
+            }
+        }
+
+        double particleSteps = 0;
+
+        std::cout<<"run,group,processes,particles,omega,softening length,seed,steps,seconds,steps/s,energy drift\n";
+        for(std::vector<double>& run : runs)
+        {
+            std::cout<<(long)run[RUN_INDEX]<<","<<(long)run[RUN_GROUP]<<","<<(long)run[RUN_PROCESSES]<<","<<(long)run[RUN_PARTICLES];
+            std::cout<<","<<run[RUN_OMEGA]<<","<<(long)run[RUN_SOFTENING_LENGTH]<<","<<(unsigned long)run[RUN_SEED]<<","<<steps;
+            std::cout<<","<<run[RUN_SECONDS]<<","<<steps / run[RUN_SECONDS]<<","<<run[RUN_ENERGY_DRIFT]<<"\n";
+
+            particleSteps += run[RUN_PARTICLES] * steps;
+        }
+
+        std::cout<<"ensemble of "<<runCount<<" runs in "<<groupCount<<" groups over "<<world.size()<<" processes: ";
+        std::cout<<totalTime<<" s, "<<particleSteps / totalTime<<" particle steps/s\n";
+    }
+
+    return 0;
+}
@@ -1,7 +1,6 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <iostream>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -9,49 +8,145 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <boost/mpi.hpp>
 #include <cstdlib>
-#include <queue>
 #include <algorithm>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "common.h"
 #include "common/shader.hpp"
 #include "Particle.h"
-#include "Cell.h"
-#include "SerializedCell.h"
+#include "Simulation.h"
+#include "MemoryTracker.h"
+#include "Tuner.h"
 
 namespace mpi = boost::mpi;
 using namespace std;
 
 // Performance
-int simulationCount = 0;
 double avgSimulationTime = 0;
+double initialEnergy = 0;
 
 // Graphics
 GLFWwindow* window;
 GLuint programID;
 GLuint VertexArrayID;
 GLuint vertexBuffer;
+GLuint massBuffer;
 GLuint colorBuffer;
 GLuint MatrixID;
+GLuint MassUnitID;
 glm::mat4 MVP;
 
-// Physics
-vector<Particle> particles;
-vector<Cell> cells;
-
+// Camera
+const float cameraPosition[3] = {2, 2, -2};
+// Vertical field of view, in degrees.
+const float fieldOfView = 45.0f;
 
-// Return a VertexBuffer for particle positions.
-GLfloat* getVertexBufferData()
+// Physics
+Simulation* simulation;
+
+// Points of a finished step, as uploaded to the vertex and mass buffers.
+struct Frame {
+    std::vector<GLfloat> vertices;
+    std::vector<GLfloat> masses;
+    long pointCount = 0;
+    long step = 0;
+};
+
+// Pipeline
+// After every step, the simulation fills a frame of its own and swaps it with the staging frame. The render loop swaps
+// the staging frame with the one it draws whenever it holds a newer step, so neither side waits for the other.
+Frame stagingFrame;
+std::mutex stagingMutex;
+std::atomic<bool> windowClosed(false);
+std::atomic<bool> simulationFinished(false);
+
+
+// Fill the vertex buffer with the particle positions, and return their number.
+// With distributed ownership, only the particles of the main process' domain are drawn.
+long getVertexBufferData(GLfloat* vertexBuffer)
 {
-    GLfloat *vertexBuffer = new GLfloat[particles.size() * 3];
+    SharedArray<Particle>& particles = simulation->particles;
+    long count = DISTRIBUTED_OWNERSHIP ? simulation->ownedCount : particles.size();
 
-    for(int i=0, j=0; i<particles.size(); i++, j+=3)
+    for(int i=0, j=0; i<count; i++, j+=3)
     {
         vertexBuffer[j] = (GLfloat)particles[i].x;
         vertexBuffer[j+1] = (GLfloat)particles[i].y;
         vertexBuffer[j+2] = (GLfloat)particles[i].z;
     }
 
-    return vertexBuffer;
+    return count;
+}
+
+
+// Fill the vertex and mass buffers with the centers of mass of the tree cells small enough on screen, and return
+// their number. Leaves are always drawn as a single point, so only the tree is read and not the particles.
+long getLodBufferData(GLfloat* vertexBuffer, GLfloat* massBuffer)
+{
+    SerializedCell& tree = simulation->tree;
+    // Pixels covered by a length of 1 at a distance of 1 from the camera.
+    float pixelsPerUnit = WINDOW_HEIGHT / (2 * std::tan(glm::radians(fieldOfView) / 2));
+    long count = 0;
+    long cell = 0;
+
+    while(cell < tree.cellCount)
+    {
+        float* cellFloats = &tree.serializedCellMatrixFloats[cell * SerializedCell::FLOATS_PER_CELL];
+        int* cellInts = &tree.serializedCellMatrixInts[cell * SerializedCell::INTS_PER_CELL];
+
+        float dx = cellFloats[6] - cameraPosition[0];
+        float dy = cellFloats[7] - cameraPosition[1];
+        float dz = cellFloats[8] - cameraPosition[2];
+        float distance = std::sqrt(dx*dx + dy*dy + dz*dz);
+
+        if(cellInts[0] == 0)
+        {
+            cell = cellInts[2];
+        }
+        else if(tree.isLeaf(cell) || (cellFloats[1] - cellFloats[0]) * pixelsPerUnit < LOD_PIXEL_SIZE * distance)
+        {
+            vertexBuffer[3*count] = cellFloats[6];
+            vertexBuffer[3*count + 1] = cellFloats[7];
+            vertexBuffer[3*count + 2] = cellFloats[8];
+            massBuffer[count] = cellFloats[9];
+            count++;
+
+            cell = cellInts[2];
+        }
+        else
+        {
+            cell++;
+        }
+    }
+
+    return count;
+}
+
+
+// Copy the points of the current step to the frame.
+void snapshot(Frame& frame)
+{
+    // With distributed ownership, the tree also holds the imported particles, so it can have more leaves than
+    // PARTICLE_COUNT. The GPU buffers only have room for PARTICLE_COUNT points.
+    long capacity = std::max((long)PARTICLE_COUNT, simulation->particles.size());
+    frame.vertices.resize(3 * capacity);
+    frame.masses.resize(capacity);
+
+    if(LOD_RENDERING)
+    {
+        frame.pointCount = getLodBufferData(frame.vertices.data(), frame.masses.data());
+    }
+    else
+    {
+        frame.pointCount = getVertexBufferData(frame.vertices.data());
+    }
+    frame.pointCount = std::min(frame.pointCount, (long)PARTICLE_COUNT);
+
+    frame.step = simulation->stepCount;
 }
 
 
@@ -89,6 +184,9 @@ void initGraphics()
         return;
     }
 
+    // Frames are paced by the display.
+    glfwSwapInterval(1);
+
     // Ensure we can capture the escape key.
     glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
 
@@ -107,13 +205,17 @@ void initGraphics()
 
     // Get a handle for the ModelViewProjection matrix.
     MatrixID = glGetUniformLocation(programID, "MVP");
+    MassUnitID = glGetUniformLocation(programID, "massUnit");
+
+    // Point sizes are set by the vertex shader.
+    glEnable(GL_PROGRAM_POINT_SIZE);
 
     // Projection matrix : 45 degree Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
-    glm::mat4 Projection = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, 100.0f);
+    glm::mat4 Projection = glm::perspective(glm::radians(fieldOfView), 4.0f / 3.0f, 0.1f, 100.0f);
 
     // Camera matrix
     glm::mat4 View = glm::lookAt(
-            glm::vec3(2, 2, -2), // camera position
+            glm::vec3(cameraPosition[0], cameraPosition[1], cameraPosition[2]), // camera position
             glm::vec3(0,0,0), // looks at origin
             glm::vec3(0,1,0)  // Head is up (set to 0,-1,0 to look upside-down)
     );
@@ -126,25 +228,47 @@ void initGraphics()
 
     glGenBuffers(1, &vertexBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, GL_FLOAT * 3 * PARTICLE_COUNT, NULL, GL_DYNAMIC_DRAW);
-}
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * PARTICLE_COUNT, NULL, GL_DYNAMIC_DRAW);
 
-
-void initPhysics()
-{
-    // Initialize the particle vector with a plummer sphere density.
-    Particle::plummerSphereDensity(particles, PARTICLE_COUNT, SOFTENING_LENGTH, G);
+    // The cells drawn are disjoint and not empty, so there are never more of them than particles.
+    glGenBuffers(1, &massBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, massBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * PARTICLE_COUNT, NULL, GL_DYNAMIC_DRAW);
 }
 
 
 void init()
 {
-    initGraphics();
-    initPhysics();
+    mpi::communicator world;
+
+    if(world.rank() == 0)
+    {
+        initGraphics();
+    }
+
+    simulation = new Simulation(world, PARTICLE_COUNT, SEED);
+
+    if(AUTO_TUNING)
+    {
+        Tuner tuner;
+        if(!tuner.run(*simulation))
+        {
+            if(world.rank() == 0)
+            {
+                fprintf(stderr, "Auto-tuning needs all the particles on every process and open boundaries, keeping the default parameters\n");
+            }
+        }
+        else if(world.rank() == 0)
+        {
+            std::cout<<(tuner.loaded ? "tuning from " + std::string(TUNING_FILE) : std::string("tuned"))<<": omega "<<tuner.best.omega;
+            std::cout<<", leaf capacity "<<tuner.best.leafCapacity<<", "<<tuner.best.threadCount<<" threads";
+            std::cout<<", force error "<<tuner.forceError<<", "<<tuner.stepTime<<" s per step\n";
+        }
+    }
 }
 
-// Render the curent step.
-void render()
+// Render the frame.
+void render(Frame& frame)
 {
     // Clear the screen
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -154,6 +278,7 @@ void render()
 
     // Send MVP matrix
     glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
+    glUniform1f(MassUnitID, (MIN_MASS + MAX_MASS) / 2.0f);
 
 
     // Prepare the vertex buffer.
@@ -168,250 +293,228 @@ void render()
             (void*)0            // array buffer offset
     );
 
-    GLfloat* g_vertex_buffer_data = getVertexBufferData();
+    if(LOD_RENDERING)
+    {
+        // Upload the masses, sizing the points.
+        glEnableVertexAttribArray(1);
+        glBindBuffer(GL_ARRAY_BUFFER, massBuffer);
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * frame.pointCount, frame.masses.data());
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    }
+    else
+    {
+        // Every particle is drawn as a single pixel.
+        glDisableVertexAttribArray(1);
+        glVertexAttrib1f(1, (MIN_MASS + MAX_MASS) / 2.0f);
+    }
 
     // Update vertex data
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 3 * PARTICLE_COUNT, g_vertex_buffer_data);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 3 * frame.pointCount, frame.vertices.data());
 
     // Draw
-    glDrawArrays(GL_POINTS, 0, PARTICLE_COUNT);
+    glDrawArrays(GL_POINTS, 0, (GLsizei)frame.pointCount);
 
-    glEnableVertexAttribArray(0);
+    glDisableVertexAttribArray(0);
 
 
     // Swap buffers
     glfwSwapBuffers(window);
     glfwPollEvents();
 
-    delete g_vertex_buffer_data;
+    windowClosed = glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS || glfwWindowShouldClose(window);
 }
 
 
-// Run a simulation step.
-void simulate()
+// Draw the newest step handed over by the simulation, until the simulation ends.
+void renderLoop()
 {
-    mpi::communicator world;
+    Frame frame;
 
-    // First create the empty tree up to the second level (so that we have better potential for parallelism).
-    // This way we can scale up to 64 cores.
-    Cell *root = new Cell(COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE);
-    root->expandChildren();
-
-    std::vector<Cell*> secondLevelCells;
-    for(int i=0; i<root->children.size(); i++)
+    while(!simulationFinished)
     {
-        root->children[i]->expandChildren();
-
-        for(int j=0; j<root->children[i]->children.size(); j++)
         {
-            secondLevelCells.push_back(root->children[i]->children[j]);
+            std::lock_guard<std::mutex> lock(stagingMutex);
+            if(stagingFrame.step > frame.step)
+            {
+                std::swap(stagingFrame, frame);
+            }
         }
+
+        render(frame);
     }
+}
 
-    // Split the second level cells among processes.
-    // We split in a round robin style because the particles tend to be grouped in a couple of regions.
-    // Thus, if adjacent regions are processed by different processes we'll have better parallelism.
-    std::vector<Cell*> cellsOfThisProcess;
 
-    for(int i = world.rank(); i < secondLevelCells.size(); i+=world.size())
-    {
-        cellsOfThisProcess.push_back(secondLevelCells[i]);
-    }
+// Step the simulation and report on every step, until the main process' window is closed.
+// When pipelined, the main process hands the steps over to the render loop, otherwise it renders them itself.
+void simulationLoop(bool pipelined)
+{
+    mpi::communicator world;
 
-    // Add all the particles.
-    // Trying to add a particle to the wrong cell of the tree is ignored, so we try to add all particles to all cells.
-    for(int i=0; i<particles.size(); i++)
+    boost::mpi::timer timer;
+    double maxTimePerProcessInThisSimulation;
+    double maxTreeDecodeTime;
+    double maxListCacheTimeSaved;
+    double maxAnalysisTime;
+    long interactions[2], totalInteractions[2];
+    double totalDiagnostics[Simulation::DIAGNOSTICS_COUNT];
+    long totalClosePairs;
+    double forceCounters[HARDWARE_COUNTER_COUNT];
+    // Current and peak bytes of every category, then the totals.
+    long memory[2 * MEMORY_CATEGORY_COUNT + 2], maxMemory[2 * MEMORY_CATEGORY_COUNT + 2];
+    bool running = true;
+    Frame frame;
+
+    while(running)
     {
-        for(int j=0; j<cellsOfThisProcess.size(); j++)
+        timer.restart();
+
+        simulation->step(1);
+
+        if(SNAPSHOT_INTERVAL > 0 && simulation->stepCount % SNAPSHOT_INTERVAL == 0)
         {
-            cellsOfThisProcess[j]->insertParticle(&particles[i]);
+            simulation->writeSnapshot("snapshot_" + std::to_string(simulation->stepCount) + ".nbs");
         }
-    }
 
-    // Now it's time to assemble the partially constructed tress on the main process.
-    // Create a serialized structure to hold cellsOfThisProcess information.
-    vector<SerializedCell> serializedCellsOfThisProcess;
+        boost::mpi::reduce(world, timer.elapsed(), maxTimePerProcessInThisSimulation, mpi::maximum<double>(), 0);
+        boost::mpi::reduce(world, simulation->treeDecodeTime, maxTreeDecodeTime, mpi::maximum<double>(), 0);
+        boost::mpi::reduce(world, simulation->listCacheTimeSaved, maxListCacheTimeSaved, mpi::maximum<double>(), 0);
+        boost::mpi::reduce(world, simulation->phaseTimes[ANALYSIS_PHASE], maxAnalysisTime, mpi::maximum<double>(), 0);
 
-    for(int i=0; i<cellsOfThisProcess.size(); i++)
-    {
-        SerializedCell serializedCell;
-        serializedCell.particleVector = &particles;
-        serializedCell.serializeTree(cellsOfThisProcess[i]);
+        interactions[0] = simulation->cellInteractions;
+        interactions[1] = simulation->particleInteractions;
+        boost::mpi::reduce(world, interactions, 2, totalInteractions, std::plus<long>(), 0);
 
-        serializedCellsOfThisProcess.push_back(serializedCell);
-    }
+        for(int i=0; i<MEMORY_CATEGORY_COUNT; i++)
+        {
+            memory[2*i] = MemoryTracker::current[i];
+            memory[2*i + 1] = MemoryTracker::peak[i];
+        }
+        memory[2 * MEMORY_CATEGORY_COUNT] = MemoryTracker::currentTotal;
+        memory[2 * MEMORY_CATEGORY_COUNT + 1] = MemoryTracker::peakTotal;
+        boost::mpi::reduce(world, memory, 2 * MEMORY_CATEGORY_COUNT + 2, maxMemory, mpi::maximum<long>(), 0);
 
-    // Gather the tree branches on the main process.
-    vector<vector<SerializedCell>> gatheredSecondLevelBranches;
-    mpi::gather(world, serializedCellsOfThisProcess, gatheredSecondLevelBranches, 0);
+        if(simulation->countHardwareEvents)
+        {
+            boost::mpi::reduce(world, simulation->phaseCounters[FORCE_PHASE], HARDWARE_COUNTER_COUNT, forceCounters, std::plus<double>(), 0);
+        }
 
-    // Clear the old Cell data to clear up space for the new.
-    delete root;
-    secondLevelCells.clear();
-    cellsOfThisProcess.clear();
+        if(simulation->diagnosticsComputed)
+        {
+            boost::mpi::reduce(world, simulation->diagnostics, Simulation::DIAGNOSTICS_COUNT, totalDiagnostics, std::plus<double>(), 0);
+            boost::mpi::reduce(world, simulation->closePairCount, totalClosePairs, std::plus<long>(), 0);
+        }
 
-    // Rebuild the tree from branches on the main process
-    if(world.rank() == 0)
-    {
-        vector<Cell*> secondLevelBranches(64);
-        for(int i=0; i<gatheredSecondLevelBranches.size(); i++)
+        if(world.rank() == 0)
         {
-            for(int j=0; j<gatheredSecondLevelBranches[i].size(); j++)
+            long simulationCount = simulation->stepCount;
+            avgSimulationTime = ((avgSimulationTime * (simulationCount-1)) + maxTimePerProcessInThisSimulation) / simulationCount;
+            std::cout<<avgSimulationTime;
+            std::cout<<" interactions "<<totalInteractions[0]<<" cells + "<<totalInteractions[1]<<" particles";
+
+            if(maxTreeDecodeTime > 0)
             {
-                // Set the particle vector pointer which was lost during serialization / deserialization.
-                gatheredSecondLevelBranches[i][j].particleVector = &particles;
+                std::cout<<", tree broadcast "<<simulation->treeBroadcastBytes<<" of "<<simulation->uncompressedTreeBytes<<" bytes";
+                std::cout<<", decode "<<simulation->treeBroadcastBytes / maxTreeDecodeTime / 1e6<<" MB/s";
+            }
 
-                secondLevelBranches[j * gatheredSecondLevelBranches.size() + i] = gatheredSecondLevelBranches[i][j].deserializeTree();
+            if(INTERACTION_LIST_CACHING)
+            {
+                long listSteps = simulation->listCacheHits + simulation->listCacheMisses;
+                std::cout<<", interaction lists reused "<<100.0 * simulation->listCacheHits / listSteps<<"%";
+                std::cout<<" saving "<<maxListCacheTimeSaved<<" s";
             }
-        }
 
-        root = new Cell(COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE, COORDINATE_MIN_VALUE, COORDINATE_MAX_VALUE);
-        root->expandChildren();
+            if(ANALYSIS_INTERVAL > 0 && simulationCount % ANALYSIS_INTERVAL == 0)
+            {
+                std::cout<<", analysis "<<maxAnalysisTime<<" s";
+            }
 
-        for(int i=0, k=0; i<root->children.size(); i++)
-        {
-            for(int j=0; j<root->children.size(); j++, k++)
+            if(simulation->countHardwareEvents && forceCounters[CYCLES] > 0)
             {
-                root->children[i]->children.push_back(secondLevelBranches[k]);
+                double interactionCount = (double)(totalInteractions[0] + totalInteractions[1]);
+                std::cout<<", forces "<<forceCounters[INSTRUCTIONS] / forceCounters[CYCLES]<<" instructions per cycle, ";
+                std::cout<<forceCounters[CACHE_MISSES] / interactionCount<<" cache misses and ";
+                std::cout<<forceCounters[BRANCH_MISSES] / interactionCount<<" branch misses per interaction";
             }
-        }
 
-        // Calculate the center of gravity, the total mass and the particle count for the root and first level nodes.
-        for(int i=0; i<root->children.size(); i++)
-        {
-            for(int j=0; j<root->children[i]->children.size(); j++)
+            if(simulation->diagnosticsComputed)
             {
-                root->children[i]->xCenter = (root->children[i]->totalMass * root->children[i]->xCenter + root->children[i]->children[j]->totalMass * root->children[i]->children[j]->xCenter) / (root->children[i]->totalMass + root->children[i]->children[j]->totalMass);
-                root->children[i]->yCenter = (root->children[i]->totalMass * root->children[i]->yCenter + root->children[i]->children[j]->totalMass * root->children[i]->children[j]->yCenter) / (root->children[i]->totalMass + root->children[i]->children[j]->totalMass);
-                root->children[i]->zCenter = (root->children[i]->totalMass * root->children[i]->zCenter + root->children[i]->children[j]->totalMass * root->children[i]->children[j]->zCenter) / (root->children[i]->totalMass + root->children[i]->children[j]->totalMass);
+                double energy = totalDiagnostics[0] + totalDiagnostics[1];
+                if(simulationCount == 1)
+                {
+                    initialEnergy = energy;
+                }
 
-                root->children[i]->totalMass += root->children[i]->children[j]->totalMass;
-                root->children[i]->particleCount += root->children[i]->children[j]->particleCount;
+                std::cout<<", energy "<<energy<<" (kinetic "<<totalDiagnostics[0]<<", potential "<<totalDiagnostics[1]<<")";
+                std::cout<<" drift "<<(energy - initialEnergy) / std::abs(initialEnergy);
+                std::cout<<", momentum "<<totalDiagnostics[2]<<" "<<totalDiagnostics[3]<<" "<<totalDiagnostics[4];
+                std::cout<<", angular momentum "<<totalDiagnostics[5]<<" "<<totalDiagnostics[6]<<" "<<totalDiagnostics[7];
+                std::cout<<", close pairs "<<totalClosePairs;
             }
 
-            root->xCenter = (root->totalMass * root->xCenter + root->children[i]->totalMass * root->children[i]->xCenter) / (root->totalMass + root->children[i]->totalMass);
-            root->yCenter = (root->totalMass * root->yCenter + root->children[i]->totalMass * root->children[i]->yCenter) / (root->totalMass + root->children[i]->totalMass);
-            root->zCenter = (root->totalMass * root->zCenter + root->children[i]->totalMass * root->children[i]->zCenter) / (root->totalMass + root->children[i]->totalMass);
-
-            root->totalMass += root->children[i]->totalMass;
-            root->particleCount += root->children[i]->particleCount;
+            // Largest current / peak use of any process.
+            std::cout<<", memory";
+            for(int i=0; i<MEMORY_CATEGORY_COUNT; i++)
+            {
+                std::cout<<" "<<MemoryTracker::name((MemoryCategory)i)<<" "<<maxMemory[2*i] / 1024<<"/"<<maxMemory[2*i + 1] / 1024;
+            }
+            std::cout<<" total "<<maxMemory[2 * MEMORY_CATEGORY_COUNT] / 1024<<"/"<<maxMemory[2 * MEMORY_CATEGORY_COUNT + 1] / 1024<<" KB";
+            std::cout<<"\n";
         }
-    }
-
-    // Broadcast the newly built tree to all other processes.
-    SerializedCell serializedRoot;
-
-    if(world.rank() == 0)
-    {
-        serializedRoot.particleVector = &particles;
-        serializedRoot.serializeTree(root);
-    }
-
-    mpi::broadcast(world, serializedRoot, 0);
-
-    if(world.rank() != 0)
-    {
-        root = serializedRoot.deserializeTree();
-    }
-
-    vector<Cell*> cells;
-    serializedRoot.sdrTraversal(cells, root);
-
-    // Update the velocity of the particles after interacting with other particles or clusters of particles.
-    for(int i = world.rank(); i < particles.size(); i+=world.size())
-    {
-        std::list<Cell*> cellQueue;
-        cellQueue.push_front(root);
 
-        while(!cellQueue.empty())
+        if(world.rank() == 0)
         {
-            Cell *crtCell = cellQueue.front();
-            cellQueue.pop_front();
+            snapshot(frame);
 
-            if(crtCell->isFarEnoughFromParticleToUseAsCluster(&particles[i]))
+            if(pipelined)
             {
-                // Ignore empty cells
-                if(crtCell->particleCount > 0)
-                {
-                    particles[i].forcePush(crtCell, TIMESTEP);
-                }
+                std::lock_guard<std::mutex> lock(stagingMutex);
+                std::swap(frame, stagingFrame);
             }
             else
             {
-                for(int j=0; j<crtCell->children.size(); j++)
-                {
-                    cellQueue.push_back(crtCell->children[j]);
-                }
+                render(frame);
             }
-        }
-
-        // Update the particles position after it's velocity has been updated.
-        particles[i].updatePosition(TIMESTEP);
-    }
-
-    // Gather the partially calculated particle vectors on all processes and assemble the final particle vector
-    vector<vector<Particle>> gatheredParticleVectors;
-    mpi::all_gather(world, particles, gatheredParticleVectors);
 
-    for(int i=0; i<gatheredParticleVectors.size(); i++)
-    {
-        for(int j=i; j<gatheredParticleVectors[i].size(); j+=gatheredParticleVectors.size())
-        {
-            particles[j] = gatheredParticleVectors[i][j];
+            running = !windowClosed;
         }
+
+        mpi::broadcast(world, running, 0);
     }
 
-    // Cleanup
-    delete root;
+    simulationFinished = true;
 }
 
 
 int main(int argc, char** argv)
 {
-    mpi::environment env;
+    // The main process steps the simulation on a thread of its own, which makes the MPI calls while the main thread
+    // renders. Without that support from MPI, it renders between the steps instead.
+    mpi::environment env(argc, argv, mpi::threading::serialized);
     mpi::communicator world;
+    bool pipelined = env.thread_level() >= mpi::threading::serialized;
 
-    boost::mpi::timer timer;
-    double maxTimePerProcessInThisSimulation;
+    init();
 
-    //srand(100);
-    srand(time(NULL));
-
-    if(world.rank() == 0)
+    if(world.rank() == 0 && pipelined)
     {
-        init();
+        std::thread simulationThread(simulationLoop, true);
+        renderLoop();
+        simulationThread.join();
     }
-
-    mpi::broadcast(world, particles, 0);
-
-    while(true)
+    else
     {
-        timer.restart();
-
-        simulate();
-
-        simulationCount++;
-        boost::mpi::reduce(world, timer.elapsed(), maxTimePerProcessInThisSimulation, mpi::maximum<double>(), 0);
-
-        if(world.rank() == 0)
-        {
-            avgSimulationTime = ((avgSimulationTime * (simulationCount-1)) + maxTimePerProcessInThisSimulation) / simulationCount;
-            std::cout<<avgSimulationTime<<"\n";
-        }
-
-        // Wait for simulation to end on all instances.
-        world.barrier();
-
-        // Render on the main instance.
-        if(world.rank() == 0)
-        {
-            render();
-        }
+        simulationLoop(pipelined);
+    }
 
-        // Render at about 60FPS.
-        nanosleep((const struct timespec[]){{0, 16666667}}, NULL);
+    // The simulation's shared memory and communicators have to be released before MPI is finalized.
+    delete simulation;
 
-        world.barrier();
+    if(world.rank() == 0)
+    {
+        glfwTerminate();
     }
 
     return 0;
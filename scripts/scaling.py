@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Strong and weak scaling benchmark of the headless simulation.
+
+Runs nBodyBenchmark with mpirun on localhost over a matrix of process and particle counts,
+with a fixed seed and number of steps, and writes the per phase timings along with the
+speedup and parallel efficiency of every run to a CSV file.
+
+Strong scaling keeps the number of particles and compares against the run with the fewest
+processes: speedup = T(p0) / T(p) and efficiency = speedup * p0 / p.
+Weak scaling keeps the number of particles per process: efficiency = T(p0) / T(p).
+"""
+
+import argparse
+import csv
+import shlex
+import subprocess
+import sys
+
+
+def int_list(value):
+    return [int(item) for item in value.split(",") if item]
+
+
+def run(arguments, processes, particles):
+    command = [arguments.mpirun, "-np", str(processes)] + shlex.split(arguments.mpirun_args) + [
+        arguments.binary,
+        "--particles", str(particles),
+        "--steps", str(arguments.steps),
+        "--warmup", str(arguments.warmup),
+        "--seed", str(arguments.seed),
+        "--header",
+    ]
+    print(" ".join(command), file=sys.stderr)
+
+    output = subprocess.run(command, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, check=True,
+                            universal_newlines=True).stdout
+    lines = [line for line in output.splitlines() if "," in line]
+    header, values = lines[-2].split(","), lines[-1].split(",")
+
+    return dict(zip(header, values))
+
+
+def add_scaling(runs, mode):
+    baseline = runs[0]
+    baseline_time = float(baseline["total"])
+    baseline_processes = int(baseline["processes"])
+
+    for result in runs:
+        time = float(result["total"])
+        processes = int(result["processes"])
+        result["mode"] = mode
+
+        if mode == "strong":
+            result["speedup"] = baseline_time / time
+            result["efficiency"] = result["speedup"] * baseline_processes / processes
+        else:
+            result["speedup"] = baseline_time / time * processes / baseline_processes
+            result["efficiency"] = baseline_time / time
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default="./nBodyBenchmark", help="path of the nBodyBenchmark executable")
+    parser.add_argument("--processes", type=int_list, default=[1, 2, 4, 8], help="comma separated process counts")
+    parser.add_argument("--particles", type=int_list, default=[2000, 8000],
+                        help="comma separated total particle counts, for strong scaling")
+    parser.add_argument("--particles-per-process", type=int_list, default=[1000],
+                        help="comma separated particle counts per process, for weak scaling")
+    parser.add_argument("--steps", type=int, default=20)
+    parser.add_argument("--warmup", type=int, default=2)
+    parser.add_argument("--seed", type=int, default=100)
+    parser.add_argument("--mpirun", default="mpirun")
+    parser.add_argument("--mpirun-args", default="--oversubscribe", help="extra mpirun arguments")
+    parser.add_argument("--output", default="scaling.csv")
+    arguments = parser.parse_args()
+
+    results = []
+
+    for particles in arguments.particles:
+        runs = [run(arguments, processes, particles) for processes in arguments.processes]
+        add_scaling(runs, "strong")
+        results += runs
+
+    for particles_per_process in arguments.particles_per_process:
+        runs = [run(arguments, processes, particles_per_process * processes) for processes in arguments.processes]
+        add_scaling(runs, "weak")
+        results += runs
+
+    fields = ["mode"] + [field for field in results[0] if field not in ("mode", "speedup", "efficiency")]
+    fields += ["speedup", "efficiency"]
+
+    with open(arguments.output, "w", newline="") as output:
+        writer = csv.DictWriter(output, fieldnames=fields)
+        writer.writeheader()
+        writer.writerows(results)
+
+    print("wrote {} runs to {}".format(len(results), arguments.output), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,9 +1,13 @@
 #version 330 core
 
 layout(location = 0) in vec3 vertexPosition_modelspace;
+layout(location = 1) in float vertexMass;
 uniform mat4 MVP;
+// Mass drawn as a single pixel.
+uniform float massUnit;
 
 void main(){
 
     gl_Position = MVP * vec4(vertexPosition_modelspace, 1);
+    gl_PointSize = clamp(pow(vertexMass / massUnit, 1.0 / 3.0), 1.0, 16.0);
 }